@@ -0,0 +1,763 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "group.h"
+#include "hash.h"
+#include "hash_simd.h"
+#include "jhash.h"
+#include "log.h"
+#include "maglev_hash.h"
+#include "rcu.h"
+
+/* Maglev build benchmark
+ *
+ * Times the table build single-threaded and with the build threads, for
+ * one large group and for many groups at once, and checks that both give
+ * the table of the reference populate engine, MH_POPULATE_LIST. -P selects
+ * the engine of the timed builds.
+ *
+ * With -M, times the build phases instead over every table size index,
+ * dest counts from 2 to 10000 and uniform and skewed weights, and writes
+ * the median and p99 of each phase as CSV, with the same check per cell.
+ *
+ * With -H, times the flow hash functions instead, on the 36 bytes of
+ * struct hash_val and on 4 to 64 byte keys, with 1 and with -t threads.
+ * The batch functions, of the instruction set of -I, are first checked
+ * against the function they batch, bit for bit.
+ */
+
+struct bench_opts {
+    int         table_idx;
+    uint32_t    table_size;     /* 0: by table_idx */
+    int         num_dests;
+    uint32_t    weight;         /* 0: mixed weights */
+    bool        skewed;         /* weights falling as 1/n, overrides weight */
+    int         num_groups;
+    unsigned    threads;
+    int         repeat;
+    enum mh_populate_engine engine;     /* of the timed builds */
+};
+
+static const char *populate_names[] = {
+    [MH_POPULATE_LIST] = "list",
+    [MH_POPULATE_FAST] = "fast",
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *v, int n)
+{
+    qsort(v, n, sizeof *v, cmp_double);
+    return v[n / 2];
+}
+
+/* The 'pct' percentile of 'v', sorted in place */
+static double percentile(double *v, int n, int pct)
+{
+    int i = (n * pct + 99) / 100 - 1;
+
+    qsort(v, n, sizeof *v, cmp_double);
+    return v[i < 0 ? 0 : i];
+}
+
+static void init_group(struct group_dpif *group, uint32_t id, const struct bench_opts *o)
+{
+    struct ofputil_bucket *bkt;
+    int i;
+
+    memset(group, 0, sizeof *group);
+    ovs_list_init(&group->up.buckets);
+
+    group->up.group_id = id;
+    group->hash_alg = o->table_idx;
+    group->mh_table_size = o->table_size;
+    group->hash_basis = MH_HASH2_JHASH;
+
+    for (i = 0; i < o->num_dests; i++) {
+        bkt = calloc(1, sizeof *bkt);
+        if (o->skewed) {
+            bkt->weight = MAX(1, 1000 / (i + 1));
+        } else {
+            bkt->weight = o->weight ? o->weight : 1 + (id * 31 + i * 7) % 100;
+        }
+        bkt->bucket_id = id * 100000 + i + 1;
+        ovs_list_push_back(&group->up.buckets, &bkt->list_node);
+    }
+}
+
+static void fini_group(struct group_dpif *group)
+{
+    struct ofputil_bucket *bkt, *next;
+
+    mh_destruct(group);
+    LIST_FOR_EACH_SAFE (bkt, next, list_node, &group->up.buckets) {
+        ovs_list_remove(&bkt->list_node);
+        free(bkt);
+    }
+}
+
+/* Returns the bucket of every slot: hash 'i' selects slot 'i'. */
+static struct ofputil_bucket** snapshot(struct group_dpif *group, uint32_t size)
+{
+    struct ofputil_bucket **buckets = calloc(size, sizeof *buckets);
+    uint32_t *hashes = calloc(size, sizeof *hashes);
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        hashes[i] = i;
+    }
+
+    mh_lookup_batch(group, hashes, size, buckets);
+    free(hashes);
+
+    return buckets;
+}
+
+static uint32_t table_size(struct group_dpif *group)
+{
+    struct maglev_hash_service *svc = ovsrcu_get(struct maglev_hash_service *, &group->mh_svc);
+
+    return svc ? svc->table_size : 0;
+}
+
+/* Builds 'group' with the reference populate engine, single-threaded, and
+ * returns the bucket of every slot. The engine and the build threads are
+ * set back to the ones of 'o'. */
+static struct ofputil_bucket** reference_snapshot(struct group_dpif *group, const struct bench_opts *o,
+                                                  unsigned threads)
+{
+    struct ofputil_bucket **buckets;
+
+    mh_set_populate_engine(MH_POPULATE_LIST);
+    mh_set_build_threads(1);
+    mh_construct(group);
+    buckets = snapshot(group, table_size(group));
+    ovsrcu_quiesce();
+
+    mh_set_populate_engine(o->engine);
+    mh_set_build_threads(threads);
+
+    return buckets;
+}
+
+/* One group, built again and again */
+static void bench_single(const struct bench_opts *o)
+{
+    struct ofputil_bucket **ref, **buckets;
+    double t0, ms[2], *v = calloc(o->repeat, sizeof *v);
+    unsigned threads[2] = { 1, o->threads };
+    struct mh_table_report report;
+    struct group_dpif group;
+    uint32_t size = 0;
+    bool same = true;
+    int m, r;
+
+    init_group(&group, 1, o);
+    ref = reference_snapshot(&group, o, 1);
+
+    for (m = 0; m < 2; m++) {
+        mh_set_build_threads(threads[m]);
+
+        for (r = 0; r < o->repeat; r++) {
+            t0 = now_ms();
+            mh_construct(&group);
+            v[r] = now_ms() - t0;
+            ovsrcu_quiesce();
+        }
+        ms[m] = median(v, o->repeat);
+
+        size = table_size(&group);
+        buckets = snapshot(&group, size);
+        same = same && !memcmp(ref, buckets, size * sizeof *buckets);
+        free(buckets);
+    }
+
+    printf("single group: table_size=%u dests=%d: %s engine, 1 thread %.3f ms, %u threads %.3f ms, speedup x%.2f, "
+           "tables %s the list engine\n", size, o->num_dests, populate_names[o->engine], ms[0], threads[1], ms[1],
+           ms[0] / ms[1], same ? "identical to" : "DIFFERENT from");
+
+    if (mh_get_table_report(&group, &report) == 0) {
+        printf("single group: slots/expected max %.3f, min %.3f, stddev %.4f\n",
+               report.max_ratio, report.min_ratio, report.stddev);
+        mh_table_report_destroy(&report);
+    }
+
+    free(ref);
+    free(v);
+    fini_group(&group);
+    ovsrcu_synchronize();
+}
+
+/* Many groups, rebuilt one by one and all at once */
+static void bench_groups(const struct bench_opts *o)
+{
+    struct group_dpif *groups = calloc(o->num_groups, sizeof *groups);
+    struct group_dpif **gp = calloc(o->num_groups, sizeof *gp);
+    double t0, seq, par;
+    int i;
+
+    for (i = 0; i < o->num_groups; i++) {
+        init_group(&groups[i], i + 1, o);
+        gp[i] = &groups[i];
+    }
+
+    mh_set_build_threads(1);
+    t0 = now_ms();
+    for (i = 0; i < o->num_groups; i++) {
+        mh_construct(gp[i]);
+    }
+    seq = now_ms() - t0;
+    ovsrcu_quiesce();
+
+    mh_set_build_threads(o->threads);
+    t0 = now_ms();
+    mh_construct_groups(gp, o->num_groups);
+    par = now_ms() - t0;
+    ovsrcu_quiesce();
+
+    printf("%d groups: one by one %.3f ms, mh_construct_groups with %u threads %.3f ms, speedup x%.2f\n",
+           o->num_groups, seq, o->threads, par, seq / par);
+
+    for (i = 0; i < o->num_groups; i++) {
+        fini_group(&groups[i]);
+    }
+    ovsrcu_synchronize();
+
+    free(gp);
+    free(groups);
+}
+
+/* Phases of the build, as columns of the matrix CSV */
+enum {
+    PHASE_SETUP,
+    PHASE_GCD,
+    PHASE_ALLOC,
+    PHASE_PERMUTATE,
+    PHASE_POPULATE,
+    PHASE_REPORT,       /* mh_get_table_report(), the former table dump */
+    PHASE_TOTAL,
+    N_PHASES
+};
+
+static const char *phase_names[N_PHASES] = {
+    "setup", "gcd", "alloc", "permutate", "populate", "report", "total",
+};
+
+/* Table size of index 'idx' */
+static uint32_t index_table_size(int idx)
+{
+    struct bench_opts o = { .table_idx = idx, .num_dests = 1, .weight = 1 };
+    struct group_dpif group;
+    uint32_t size;
+
+    init_group(&group, 1, &o);
+    mh_construct(&group);
+    size = table_size(&group);
+    fini_group(&group);
+
+    return size;
+}
+
+/* One cell of the matrix: group 'o' built o->repeat times */
+static void bench_cell(const struct bench_opts *o, FILE *csv)
+{
+    static double v[N_PHASES][1000];
+    struct ofputil_bucket **ref, **buckets;
+    struct mh_build_times times;
+    struct mh_table_report report;
+    struct group_dpif group;
+    double t0;
+    int p, r, n = MIN(o->repeat, 1000);
+    bool same;
+
+    init_group(&group, 1, o);
+    ref = reference_snapshot(&group, o, o->threads);
+
+    for (r = 0; r < n; r++) {
+        mh_construct(&group);
+        mh_get_build_times(&times);
+
+        t0 = now_ms();
+        if (mh_get_table_report(&group, &report) == 0) {
+            mh_table_report_destroy(&report);
+        }
+        v[PHASE_REPORT][r] = (now_ms() - t0) * 1e3;
+
+        v[PHASE_SETUP][r] = times.setup / 1e3;
+        v[PHASE_GCD][r] = times.gcd / 1e3;
+        v[PHASE_ALLOC][r] = times.alloc / 1e3;
+        v[PHASE_PERMUTATE][r] = times.permutate / 1e3;
+        v[PHASE_POPULATE][r] = times.populate / 1e3;
+        v[PHASE_TOTAL][r] = times.total / 1e3;
+        ovsrcu_quiesce();
+    }
+
+    buckets = snapshot(&group, table_size(&group));
+    same = !memcmp(ref, buckets, table_size(&group) * sizeof *buckets);
+    free(buckets);
+    free(ref);
+    if (!same) {
+        fprintf(stderr, "table_size=%u dests=%d %s: %s engine table DIFFERENT from the list engine\n",
+                table_size(&group), o->num_dests, o->skewed ? "skewed" : "uniform", populate_names[o->engine]);
+    }
+
+    fprintf(csv, "%u,%d,%s,%u,%d,%s,%d", table_size(&group), o->num_dests,
+            o->skewed ? "skewed" : "uniform", o->threads, n, populate_names[o->engine], same);
+    for (p = 0; p < N_PHASES; p++) {
+        fprintf(csv, ",%.3f,%.3f", percentile(v[p], n, 50), percentile(v[p], n, 99));
+    }
+    fprintf(csv, "\n");
+    fflush(csv);
+
+    fini_group(&group);
+    ovsrcu_synchronize();
+}
+
+/* Every table size index x dest count x weights, times in us */
+static void bench_matrix(const struct bench_opts *o, FILE *csv)
+{
+    static const uint32_t dests[] = { 2, 10, 100, 1000, 10000 };
+    struct bench_opts c = *o;
+    uint32_t size;
+    size_t d;
+    int i, p;
+
+    mh_set_populate_engine(o->engine);
+    mh_set_build_threads(o->threads);
+
+    fprintf(csv, "table_size,dests,weights,threads,runs,engine,identical");
+    for (p = 0; p < N_PHASES; p++) {
+        fprintf(csv, ",%s_median_us,%s_p99_us", phase_names[p], phase_names[p]);
+    }
+    fprintf(csv, "\n");
+
+    c.table_size = 0;
+    c.weight = 100;
+    for (i = 0; i <= MH_TABLE_INDEX_MAX; i++) {
+        c.table_idx = i;
+        size = index_table_size(i);
+
+        for (d = 0; d < ARRAY_SIZE(dests); d++) {
+            if (dests[d] > size)
+                break;
+            c.num_dests = dests[d];
+
+            c.skewed = false;
+            bench_cell(&c, csv);
+            c.skewed = true;
+            bench_cell(&c, csv);
+        }
+    }
+}
+
+#define HASH_KEYS       1024            /* per thread, a power of 2 */
+#define HASH_ITERS      (1 << 18)       /* hashes per thread and run */
+
+/* Flow hash functions, as called by the benchmark */
+typedef uint32_t bench_hash_fn(const void *p, size_t n, uint32_t basis);
+typedef void bench_batch_fn(const void *keys, size_t stride, size_t len, size_t n,
+                            uint32_t basis, uint32_t *hashes);
+
+static uint32_t bench_crc32c_ref(const void *p, size_t n, uint32_t basis)
+{
+    return crc32c_ref(basis, p, n);
+}
+
+static uint32_t bench_crc32c_hw_ref(const void *p, size_t n, uint32_t basis)
+{
+    return crc32c_hw_ref(basis, p, n);
+}
+
+static uint32_t bench_murmurhash(const void *p, size_t n, uint32_t basis)
+{
+    return murmurhash(p, n, basis);
+}
+
+static uint32_t bench_hash_bytes36(const void *p, size_t n OVS_UNUSED, uint32_t basis)
+{
+    return hash_bytes36(p, basis);
+}
+
+static uint32_t bench_hash_bytes36_ipv4(const void *p, size_t n OVS_UNUSED, uint32_t basis)
+{
+    const struct hash_val *key = p;
+
+    return hash_bytes36_ipv4(key->pkt.ipv4_addr, key->tp_port, basis);
+}
+
+/* At most HASH_KEYS keys */
+static void bench_hash_bytes36_batch(const void *keys, size_t stride, size_t len OVS_UNUSED, size_t n,
+                                     uint32_t basis, uint32_t *hashes)
+{
+    uint32_t bases[HASH_KEYS];
+    size_t i;
+
+    if (!basis) {
+        hash_bytes36_batch(keys, stride, n, NULL, hashes);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        bases[i] = basis;
+    }
+    hash_bytes36_batch(keys, stride, n, bases, hashes);
+}
+
+static const struct {
+    const char      *name;
+    bench_hash_fn   *fn;
+    size_t          len;                        /* 0: any */
+    bench_batch_fn  *batch;                     /* instead of fn */
+    bench_hash_fn   *ref;                       /* what 'batch' must match */
+} hash_fns[] = {
+    { .name = "hash_bytes",    .fn = hash_bytes },                  /* engine of -e */
+    { .name = "hash_bytes36",  .fn = bench_hash_bytes36, .len = 36 },
+    { .name = "hash36_batch",  .batch = bench_hash_bytes36_batch, .ref = bench_hash_bytes36, .len = 36 },
+    { .name = "hash36_ipv4",   .fn = bench_hash_bytes36_ipv4, .len = 36 },   /* IPv4 keys only */
+    { .name = "hash_bytes1",   .fn = hash_bytes1 },                 /* bitwise */
+    { .name = "hash_bytes2",   .fn = hash_bytes2 },                 /* table */
+    { .name = "hash_bytes3",   .fn = hash_bytes3 },                 /* slicing-by-8 */
+    { .name = "crc32c_ref",    .fn = bench_crc32c_ref },
+    { .name = "crc32c_hw_ref", .fn = bench_crc32c_hw_ref },
+    { .name = "jhash_bytes",   .fn = jhash_bytes },
+    { .name = "murmurhash",    .fn = bench_murmurhash },
+    { .name = "jhash_batch",   .batch = jhash_bytes_batch, .ref = jhash_bytes },
+    { .name = "murmur_batch",  .batch = murmurhash_batch, .ref = bench_murmurhash },
+};
+
+struct hash_job {
+    bench_hash_fn       *fn;
+    bench_batch_fn      *batch;
+    size_t              len;
+    uint8_t             *keys;          /* HASH_KEYS keys of 'len' bytes */
+    pthread_barrier_t   *start;
+    double              t0, t1;         /* ms, taken by the thread */
+    uint32_t            sink;
+};
+
+/* Random keys; the hash_val ones as filled by get_hash() of the sim. */
+static uint8_t* hash_keys(size_t len, unsigned seed)
+{
+    uint8_t *keys = calloc(HASH_KEYS, len);
+    struct hash_val hval;
+    size_t i, j;
+
+    for (i = 0; i < HASH_KEYS; i++) {
+        if (len == sizeof hval) {
+            memset(&hval, 0, sizeof hval);
+            hval.pkt.ipv4_addr = rand_r(&seed) ^ rand_r(&seed) << 16;
+            hval.tp_port = rand_r(&seed);
+            memcpy(&keys[i * len], &hval, sizeof hval);
+        } else {
+            for (j = 0; j < len; j++) {
+                keys[i * len + j] = rand_r(&seed);
+            }
+        }
+    }
+
+    return keys;
+}
+
+static void* hash_job_run(void *arg)
+{
+    struct hash_job *job = arg;
+    uint32_t hashes[HASH_KEYS];
+    uint32_t h = 0, i, j;
+
+    pthread_barrier_wait(job->start);
+    job->t0 = now_ms();
+    if (job->batch) {
+        /* all the keys at once */
+        for (i = 0; i < HASH_ITERS; i += HASH_KEYS) {
+            job->batch(job->keys, job->len, job->len, HASH_KEYS, 0, hashes);
+            for (j = 0; j < HASH_KEYS; j++) {
+                h ^= hashes[j];
+            }
+        }
+    } else {
+        for (i = 0; i < HASH_ITERS; i++) {
+            h ^= job->fn(&job->keys[(i & (HASH_KEYS - 1)) * job->len], job->len, 0);
+        }
+    }
+    job->t1 = now_ms();
+    job->sink = h;
+
+    return NULL;
+}
+
+/* Wall time in ms of HASH_ITERS hashes by each of 'n' threads */
+static double hash_run(struct hash_job *jobs, unsigned n)
+{
+    pthread_t tids[n];
+    pthread_barrier_t start;
+    double t0, t1;
+    unsigned i;
+
+    pthread_barrier_init(&start, NULL, n);
+    for (i = 0; i < n; i++) {
+        jobs[i].start = &start;
+        pthread_create(&tids[i], NULL, hash_job_run, &jobs[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&start);
+
+    /* from the first start to the last end, as seen by the threads */
+    t0 = jobs[0].t0;
+    t1 = jobs[0].t1;
+    for (i = 1; i < n; i++) {
+        t0 = MIN(t0, jobs[i].t0);
+        t1 = MAX(t1, jobs[i].t1);
+    }
+
+    return t1 - t0;
+}
+
+/* Returns the number of the HASH_KEYS 'keys' of 'len' bytes whose hash by
+ * the batch function of 'fn' differs from its reference. The keys are
+ * hashed with two bases, and all at once and in a short batch that leaves
+ * a partial vector. */
+static size_t hash_check_batch(size_t fn, const uint8_t *keys, size_t len)
+{
+    static const uint32_t bases[] = { 0, 0x9e3779b9 };
+    static const size_t ns[] = { HASH_KEYS, 13 };
+    uint32_t hashes[HASH_KEYS];
+    size_t b, k, i, bad = 0;
+
+    for (b = 0; b < ARRAY_SIZE(bases); b++) {
+        for (k = 0; k < ARRAY_SIZE(ns); k++) {
+            memset(hashes, 0, sizeof hashes);
+            hash_fns[fn].batch(keys, len, len, ns[k], bases[b], hashes);
+            for (i = 0; i < ns[k]; i++) {
+                bad += hashes[i] != hash_fns[fn].ref(&keys[i * len], len, bases[b]);
+            }
+        }
+    }
+
+    return bad;
+}
+
+/* ns/hash of one thread and GB/s of all the threads, median of the runs.
+ * Returns the number of batch functions that differ from their reference. */
+static int bench_hash(const struct bench_opts *o)
+{
+    static const size_t lens[] = { sizeof(struct hash_val), 4, 8, 16, 64 };
+    unsigned threads[2] = { 1, o->threads };
+    struct hash_job *jobs = calloc(o->threads, sizeof *jobs);
+    double *v = calloc(o->repeat, sizeof *v), ms;
+    size_t f, l, bad;
+    int m, r, failed = 0;
+    unsigned i;
+
+    swtab_init_crc32c();
+    init_table_ref();
+
+    printf("%-14s %5s %8s %12s %10s\n", "function", "bytes", "threads", "ns/hash", "GB/s");
+
+    for (l = 0; l < ARRAY_SIZE(lens); l++) {
+        for (i = 0; i < o->threads; i++) {
+            jobs[i].len = lens[l];
+            jobs[i].keys = hash_keys(lens[l], i + 1);
+        }
+
+        for (f = 0; f < ARRAY_SIZE(hash_fns); f++) {
+            if (hash_fns[f].len && hash_fns[f].len != lens[l])
+                continue;
+
+            if (hash_fns[f].batch && hash_fns[f].ref
+                && (bad = hash_check_batch(f, jobs[0].keys, lens[l])) != 0) {
+                printf("%-14s %5zu DIFFERENT from the function it batches on %zu hashes\n",
+                       hash_fns[f].name, lens[l], bad);
+                failed++;
+                continue;
+            }
+
+            for (m = 0; m < (o->threads > 1 ? 2 : 1); m++) {
+                for (i = 0; i < threads[m]; i++) {
+                    jobs[i].fn = hash_fns[f].fn;
+                    jobs[i].batch = hash_fns[f].batch;
+                }
+                for (r = 0; r < o->repeat; r++) {
+                    v[r] = hash_run(jobs, threads[m]);
+                }
+                ms = median(v, o->repeat);
+
+                printf("%-14s %5zu %8u %12.2f %10.3f\n", hash_fns[f].name, lens[l], threads[m],
+                       ms * 1e6 / HASH_ITERS,
+                       (double)threads[m] * HASH_ITERS * lens[l] / (ms * 1e6));
+            }
+        }
+
+        for (i = 0; i < o->threads; i++) {
+            free(jobs[i].keys);
+        }
+    }
+
+    free(v);
+    free(jobs);
+
+    return failed;
+}
+
+void print_usage(char *pgname) {
+    printf("usage: %s [-h] [-i idx] [-m size | -a] [-n dests] [-w weight] [-g groups] [-t threads] [-r repeat] [-P engine] [-M [-o file] | -H [-e engine] [-I isa]]\n", pgname);
+    printf("options:\n");
+    printf("  -h         : print this help  \n");
+    printf("  -i [idx]   : table size index (default 10)\n");
+    printf("  -m [size]  : table size, rounded up to a prime (overrides -i)\n");
+    printf("  -a         : table size by the number of dests (overrides -i)\n");
+    printf("  -n [dests] : dests per group (default 1000)\n");
+    printf("  -w [weight]: weight of every dest, 0 for mixed weights (default 0)\n");
+    printf("  -g [groups]: groups for the many-groups build (default 200)\n");
+    printf("  -t [num]   : build threads (default: online CPUs)\n");
+    printf("  -r [num]   : repetitions of each build (default 10, at most 1000 with -M)\n");
+    printf("  -P [name]  : populate engine of the timed builds: list, fast (default fast)\n");
+    printf("  -M         : time the build phases over the size x dests x weights matrix\n");
+    printf("  -o [file]  : CSV output of -M (default: stdout)\n");
+    printf("  -H         : time the flow hash functions on 4 to 64 byte keys\n");
+    printf("  -e [name]  : engine of hash_bytes: auto, sse4.2-u64, sse4.2, slice8, table, bitwise\n");
+    printf("  -I [isa]   : instruction set of the batch hash functions: auto, avx512, avx2, scalar\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_opts o = {
+        .table_idx = 10,
+        .num_dests = 1000,
+        .num_groups = 200,
+        .repeat = 10,
+        .engine = MH_POPULATE_FAST,
+    };
+    bool by_dests = false, matrix = false, hash = false;
+    const char *out = NULL;
+    FILE *csv = stdout;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, engine;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "hi:m:an:w:g:t:r:P:Mo:He:I:")) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            case 'i':
+                o.table_idx = atoi(optarg);
+                break;
+            case 'm':
+                o.table_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                by_dests = true;
+                break;
+            case 'n':
+                o.num_dests = atoi(optarg);
+                break;
+            case 'w':
+                o.weight = strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                o.num_groups = atoi(optarg);
+                break;
+            case 't':
+                o.threads = atoi(optarg);
+                break;
+            case 'r':
+                o.repeat = atoi(optarg);
+                break;
+            case 'P':
+                for (i = 0; i < ARRAY_SIZE(populate_names); i++) {
+                    if (!strcmp(optarg, populate_names[i]))
+                        break;
+                }
+                if (i == ARRAY_SIZE(populate_names)) {
+                    fprintf(stderr, "populate engine %s not supported\n", optarg);
+                    return 1;
+                }
+                o.engine = i;
+                break;
+            case 'M':
+                matrix = true;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'H':
+                hash = true;
+                break;
+            case 'e':
+                engine = hash_engine_from_name(optarg);
+                if (engine < 0 || hash_set_engine(engine) < 0) {
+                    fprintf(stderr, "flow hash engine %s not supported\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'I':
+                engine = hash_batch_isa_from_name(optarg);
+                if (engine < 0 || hash_batch_set_isa(engine) < 0) {
+                    fprintf(stderr, "batch instruction set %s not supported\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (o.threads < 1)
+        o.threads = cpus > 1 ? cpus : 1;
+    if (o.repeat < 1)
+        o.repeat = 1;
+    if (by_dests)
+        o.table_size = mh_table_size_for_dests(o.num_dests);
+
+    current_log_level = LOG_LEVEL_WARN;
+
+    if (hash) {
+        printf("online CPUs: %ld, hash_bytes engine: %s, batch: %s\n", cpus,
+               hash_engine_name(hash_get_engine()), hash_batch_isa_name(hash_batch_get_isa()));
+        return bench_hash(&o) ? 1 : 0;
+    }
+
+    if (matrix) {
+        if (out && !(csv = fopen(out, "w"))) {
+            perror(out);
+            return 1;
+        }
+        bench_matrix(&o, csv);
+        if (csv != stdout)
+            fclose(csv);
+        mh_set_build_threads(1);
+        return 0;
+    }
+
+    printf("online CPUs: %ld\n", cpus);
+    mh_set_populate_engine(o.engine);
+    bench_single(&o);
+    if (o.num_groups > 0) {
+        bench_groups(&o);
+    }
+
+    mh_set_build_threads(1);
+    return 0;
+}
@@ -0,0 +1,619 @@
+/* Backend churn simulator
+ *
+ * Replays a sequence of bucket events (add, remove, disable, enable,
+ * reweight) against one group, from a script and/or generated at random,
+ * and reports for each event:
+ *
+ *  - the rebuild time: mh_construct() or mh_set_dest_available()
+ *  - the share of table slots that moved to another bucket, and the part
+ *    of it that did not involve the bucket of the event (collateral moves;
+ *    Maglev keeps it small but not zero)
+ *  - the share of sample flows that moved to another bucket
+ *  - the load of the most loaded bucket over its weight share
+ *
+ * and, if asked, the lookup counters of the group after the last event.
+ *
+ * Script format, as the test vectors: '#' comments, "key:value" group
+ * settings, then one event per line:
+ *
+ *   maglev_hash_table_size_index:10
+ *   table_size:65537                 (overrides the index)
+ *   maglev_id:1
+ *   num_buckets:10                   (ids 1..num_buckets)
+ *   bucket_weight:100
+ *   maglev_hash2:jhash               (or murmur)
+ *   num_flows:100000
+ *
+ *   add <id> [weight]
+ *   remove <id>
+ *   disable <id>
+ *   enable <id>
+ *   weight <id> <weight>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "list.h"
+#include "group.h"
+#include "log.h"
+#include "maglev_hash.h"
+#include "rcu.h"
+#include "util.h"
+#include "churn.h"
+
+static const char *churn_op_names[] = {
+    [CHURN_ADD]     = "add",
+    [CHURN_REMOVE]  = "remove",
+    [CHURN_DISABLE] = "disable",
+    [CHURN_ENABLE]  = "enable",
+    [CHURN_WEIGHT]  = "weight",
+};
+
+struct churn {
+    const struct churn_script   *cs;
+    struct group_dpif           group;
+    uint32_t                    n_buckets;
+    uint32_t                    next_id;        /* for random adds */
+    uint32_t                    *disabled;      /* ids of disabled buckets */
+    uint32_t                    n_disabled;
+    uint32_t                    rng;
+
+    uint32_t                    table_size;
+    uint32_t                    *slot_hashes;   /* hash i selects slot i */
+    uint32_t                    *flow_hashes;
+    uint32_t                    *slots[2];      /* bucket id by slot, before/after */
+    uint32_t                    *flows[2];      /* bucket id by flow, before/after */
+    struct ofputil_bucket       **buckets;
+    double                      max_load;
+
+    /* totals */
+    uint32_t                    n_events;
+    uint32_t                    n_skipped;      /* events that did not apply */
+    double                      rebuild_ms, max_rebuild_ms;
+    double                      slots_moved, collateral, flows_moved;
+};
+
+static uint32_t churn_random(struct churn *c)
+{
+    /* xorshift32 */
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+
+    return c->rng;
+}
+
+static double churn_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void churn_script_init(struct churn_script *cs)
+{
+    memset(cs, 0, sizeof *cs);
+
+    cs->maglev_hash_table_size_index = 10;
+    cs->maglev_id = 1;
+    cs->num_buckets = 10;
+    cs->bucket_weight = 100;
+    cs->num_flows = 100000;
+}
+
+void churn_script_destroy(struct churn_script *cs)
+{
+    free(cs->maglev_hash2);
+    free(cs->events);
+    memset(cs, 0, sizeof *cs);
+}
+
+static int churn_add_event(struct churn_script *cs, const struct churn_event *ev)
+{
+    struct churn_event *events;
+
+    if (cs->n_events == cs->allocated) {
+        events = realloc(cs->events, (cs->allocated * 2 + 16) * sizeof *events);
+        if (!events)
+            return -ENOMEM;
+
+        cs->events = events;
+        cs->allocated = cs->allocated * 2 + 16;
+    }
+
+    cs->events[cs->n_events++] = *ev;
+
+    return 0;
+}
+
+static int churn_parse_event(char *line, struct churn_event *ev)
+{
+    char *op = strtok(line, " \t");
+    char *id = strtok(NULL, " \t");
+    char *weight = strtok(NULL, " \t");
+    size_t i;
+
+    if (!op || !id)
+        return -EINVAL;
+
+    for (i = 0; i < ARRAY_SIZE(churn_op_names); i++) {
+        if (strcmp(op, churn_op_names[i]) == 0)
+            break;
+    }
+
+    if (i == ARRAY_SIZE(churn_op_names))
+        return -EINVAL;
+
+    ev->op = i;
+    ev->id = strtoul(id, NULL, 0);
+    ev->weight = weight ? strtoul(weight, NULL, 0) : 0;
+
+    if (!ev->id || (ev->op == CHURN_WEIGHT && !weight))
+        return -EINVAL;
+
+    return 0;
+}
+
+/* Loads the settings and events of the script 'file' into 'cs', which has
+ * the defaults of churn_script_init(). */
+int churn_load_script(struct churn_script *cs, const char *file)
+{
+    struct churn_event ev;
+    char buffer[1024];
+    char *b, *key, *value;
+    int line = 0, ret = 0;
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        VLOG_ERROR("failed to open file: %s", file);
+        return -ENOENT;
+    }
+
+    while (!ret && fgets(buffer, sizeof(buffer), fp) != NULL) {
+        line++;
+        b = trim(buffer);
+        if (b[0] == '\0' || b[0] == '#')
+            continue;
+
+        if (!strchr(b, ':')) {
+            ret = churn_parse_event(b, &ev);
+            if (ret == 0)
+                ret = churn_add_event(cs, &ev);
+            else
+                VLOG_ERROR("%s:%d: bad event", file, line);
+            continue;
+        }
+
+        key = strtok(b, " :");
+        value = strtok(NULL, " :");
+        if (!value) {
+            VLOG_ERROR("%s:%d: no value for %s", file, line, key);
+            ret = -EINVAL;
+        } else if (strcmp(key, "maglev_hash_table_size_index") == 0) {
+            cs->maglev_hash_table_size_index = atoi(value);
+        } else if (strcmp(key, "table_size") == 0) {
+            cs->table_size = strtoul(value, NULL, 0);
+        } else if (strcmp(key, "maglev_id") == 0) {
+            cs->maglev_id = atoi(value);
+        } else if (strcmp(key, "num_buckets") == 0) {
+            cs->num_buckets = atoi(value);
+        } else if (strcmp(key, "bucket_weight") == 0) {
+            cs->bucket_weight = atoi(value);
+        } else if (strcmp(key, "maglev_hash2") == 0) {
+            free(cs->maglev_hash2);
+            cs->maglev_hash2 = strdup(value);
+        } else if (strcmp(key, "num_flows") == 0) {
+            cs->num_flows = atoi(value);
+        } else {
+            VLOG_INFO("Unknown data: %s", b);
+        }
+    }
+
+    fclose(fp);
+
+    return ret;
+}
+
+static struct ofputil_bucket* churn_find_bucket(struct churn *c, uint32_t id)
+{
+    struct ofputil_bucket *bkt;
+
+    LIST_FOR_EACH (bkt, list_node, &c->group.up.buckets) {
+        if (bkt->bucket_id == id)
+            return bkt;
+    }
+
+    return NULL;
+}
+
+static struct ofputil_bucket* churn_nth_bucket(struct churn *c, uint32_t n)
+{
+    struct ofputil_bucket *bkt;
+
+    LIST_FOR_EACH (bkt, list_node, &c->group.up.buckets) {
+        if (n-- == 0)
+            return bkt;
+    }
+
+    return NULL;
+}
+
+static int churn_find_disabled(struct churn *c, uint32_t id)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->n_disabled; i++) {
+        if (c->disabled[i] == id)
+            return i;
+    }
+
+    return -1;
+}
+
+static void churn_set_disabled(struct churn *c, uint32_t id, bool disabled)
+{
+    int i = churn_find_disabled(c, id);
+
+    if (disabled && i < 0) {
+        c->disabled[c->n_disabled++] = id;
+    } else if (!disabled && i >= 0) {
+        c->disabled[i] = c->disabled[--c->n_disabled];
+    }
+}
+
+static struct ofputil_bucket* churn_new_bucket(struct churn *c, uint32_t id, uint32_t weight)
+{
+    struct ofputil_bucket *bkt = calloc(1, sizeof *bkt);
+    uint32_t *disabled;
+
+    disabled = realloc(c->disabled, (c->n_buckets + 1) * sizeof *disabled);
+    if (!bkt || !disabled) {
+        free(bkt);
+        return NULL;
+    }
+
+    c->disabled = disabled;
+    bkt->weight = weight;
+    bkt->bucket_id = id;
+    ovs_list_push_back(&c->group.up.buckets, &bkt->list_node);
+    c->n_buckets++;
+    c->next_id = MAX(c->next_id, id + 1);
+
+    return bkt;
+}
+
+/* Applies 'ev' to the group and returns the time of the rebuild in '*ms'. */
+static int churn_apply(struct churn *c, const struct churn_event *ev, double *ms)
+{
+    struct ofputil_bucket *bkt = churn_find_bucket(c, ev->id);
+    struct ovs_list *next = NULL;
+    bool was_disabled = false;
+    double t0;
+    int ret = 0;
+
+    if (ev->op == CHURN_ADD ? bkt != NULL : bkt == NULL) {
+        return ev->op == CHURN_ADD ? -EEXIST : -ENOENT;
+    }
+
+    switch (ev->op) {
+    case CHURN_ADD:
+        if (!churn_new_bucket(c, ev->id, ev->weight ? ev->weight : c->cs->bucket_weight))
+            return -ENOMEM;
+        break;
+    case CHURN_REMOVE:
+        next = ovs_list_remove(&bkt->list_node);
+        c->n_buckets--;
+        was_disabled = churn_find_disabled(c, ev->id) >= 0;
+        churn_set_disabled(c, ev->id, false);
+        break;
+    case CHURN_WEIGHT:
+        bkt->weight = ev->weight;
+        break;
+    case CHURN_DISABLE:
+    case CHURN_ENABLE:
+        break;
+    }
+
+    t0 = churn_now_ms();
+    if (ev->op == CHURN_DISABLE || ev->op == CHURN_ENABLE) {
+        ret = mh_set_dest_available(&c->group, ev->id, ev->op == CHURN_ENABLE);
+        if (ret == 0)
+            churn_set_disabled(c, ev->id, ev->op == CHURN_DISABLE);
+    } else {
+        ret = mh_construct(&c->group);
+    }
+    *ms = churn_now_ms() - t0;
+
+    /* a failed build keeps the old service, which still points to it: the
+     * bucket goes back in its place, so that later builds see the same order */
+    if (ev->op == CHURN_REMOVE && ret != 0) {
+        ovs_list_insert(next, &bkt->list_node);
+        c->n_buckets++;
+        churn_set_disabled(c, ev->id, was_disabled);
+        return ret;
+    }
+
+    /* the old service does not point to the removed bucket any more */
+    ovsrcu_quiesce();
+    if (ev->op == CHURN_REMOVE)
+        free(bkt);
+
+    return ret;
+}
+
+/* Picks an event that applies to the current buckets. */
+static void churn_random_event(struct churn *c, struct churn_event *ev)
+{
+    uint32_t enabled = c->n_buckets - c->n_disabled;
+    uint32_t r = churn_random(c) % 100;
+    struct ofputil_bucket *bkt;
+
+    bkt = c->n_buckets ? churn_nth_bucket(c, churn_random(c) % c->n_buckets) : NULL;
+    ev->weight = 1 + churn_random(c) % (2 * c->cs->bucket_weight);
+
+    if (r < 25 || !bkt) {
+        ev->op = CHURN_ADD;
+        ev->id = c->next_id;
+    } else if (r < 50 && (enabled > 1 || churn_find_disabled(c, bkt->bucket_id) >= 0)) {
+        ev->op = CHURN_REMOVE;
+        ev->id = bkt->bucket_id;
+    } else if (r < 65 && enabled > 1) {
+        ev->op = CHURN_DISABLE;
+        ev->id = bkt->bucket_id;
+        if (churn_find_disabled(c, ev->id) >= 0)
+            ev->op = CHURN_ENABLE;
+    } else if (r < 80 && c->n_disabled) {
+        ev->op = CHURN_ENABLE;
+        ev->id = c->disabled[churn_random(c) % c->n_disabled];
+    } else {
+        ev->op = CHURN_WEIGHT;
+        ev->id = bkt->bucket_id;
+    }
+}
+
+static void churn_lookup_ids(struct churn *c, const uint32_t *hashes, uint32_t n, uint32_t *ids)
+{
+    uint32_t i;
+
+    mh_lookup_batch(&c->group, hashes, n, c->buckets);
+    for (i = 0; i < n; i++) {
+        ids[i] = c->buckets[i] ? c->buckets[i]->bucket_id : 0;
+    }
+}
+
+/* Takes the bucket of every slot and sample flow, keeping the previous ones */
+static int churn_snapshot(struct churn *c)
+{
+    struct mh_table_report report;
+    uint32_t *tmp, i;
+
+    if (mh_get_table_report(&c->group, &report) != 0) {
+        VLOG_ERROR("no Maglev table for group %u", c->group.up.group_id);
+        return -ENOENT;
+    }
+    c->max_load = report.max_ratio;
+    mh_table_report_destroy(&report);
+
+    if (!c->table_size) {
+        c->table_size = report.table_size;
+        c->slot_hashes = calloc(c->table_size, sizeof *c->slot_hashes);
+        c->slots[0] = calloc(c->table_size, sizeof *c->slots[0]);
+        c->slots[1] = calloc(c->table_size, sizeof *c->slots[1]);
+        c->buckets = calloc(MAX(c->table_size, c->cs->num_flows), sizeof *c->buckets);
+        if (!c->slot_hashes || !c->slots[0] || !c->slots[1] || !c->buckets)
+            return -ENOMEM;
+
+        for (i = 0; i < c->table_size; i++) {
+            c->slot_hashes[i] = i;
+        }
+    }
+
+    tmp = c->slots[0], c->slots[0] = c->slots[1], c->slots[1] = tmp;
+    tmp = c->flows[0], c->flows[0] = c->flows[1], c->flows[1] = tmp;
+
+    churn_lookup_ids(c, c->slot_hashes, c->table_size, c->slots[1]);
+    churn_lookup_ids(c, c->flow_hashes, c->cs->num_flows, c->flows[1]);
+
+    return 0;
+}
+
+static void churn_report(struct churn *c, const struct churn_event *ev, double ms)
+{
+    uint32_t i, moved = 0, collateral = 0, flows = 0;
+    uint32_t *before = c->slots[0], *after = c->slots[1];
+
+    for (i = 0; i < c->table_size; i++) {
+        if (before[i] != after[i]) {
+            moved++;
+            if (before[i] != ev->id && after[i] != ev->id)
+                collateral++;
+        }
+    }
+
+    for (i = 0; i < c->cs->num_flows; i++) {
+        flows += c->flows[0][i] != c->flows[1][i];
+    }
+
+    c->n_events++;
+    c->rebuild_ms += ms;
+    c->max_rebuild_ms = MAX(c->max_rebuild_ms, ms);
+    c->slots_moved += 100.0 * moved / c->table_size;
+    c->collateral += 100.0 * collateral / c->table_size;
+    c->flows_moved += c->cs->num_flows ? 100.0 * flows / c->cs->num_flows : 0;
+
+    printf("%5u %-8s %8u %6u %6u %9.3f %9.3f%% %9.3f%% %9.3f%% %7.3f\n",
+           c->n_events, churn_op_names[ev->op], ev->id, c->n_buckets, c->n_disabled, ms,
+           100.0 * moved / c->table_size, 100.0 * collateral / c->table_size,
+           c->cs->num_flows ? 100.0 * flows / c->cs->num_flows : 0, c->max_load);
+}
+
+static int churn_init(struct churn *c, const struct churn_script *cs, uint32_t seed, churn_hash_fn *hash)
+{
+    struct tv_entry flow;
+    uint32_t i;
+    int ret;
+
+    memset(c, 0, sizeof *c);
+    c->cs = cs;
+    c->rng = seed ? seed : 1;
+    c->next_id = 1;
+
+    ovs_list_init(&c->group.up.buckets);
+    c->group.up.group_id = cs->maglev_id;
+    c->group.hash_alg = cs->maglev_hash_table_size_index;
+    c->group.mh_table_size = cs->table_size;
+    c->group.hash_basis = MH_HASH2_JHASH;
+    if (cs->maglev_hash2 != NULL && strcmp(cs->maglev_hash2, "murmur") == 0) {
+        c->group.hash_basis = MH_HASH2_MURMUR;
+    }
+
+    for (i = 0; i < cs->num_buckets; i++) {
+        if (!churn_new_bucket(c, i + 1, cs->bucket_weight))
+            return -ENOMEM;
+    }
+
+    /* flows from random clients to one VIP */
+    c->flow_hashes = calloc(cs->num_flows, sizeof *c->flow_hashes);
+    c->flows[0] = calloc(cs->num_flows, sizeof *c->flows[0]);
+    c->flows[1] = calloc(cs->num_flows, sizeof *c->flows[1]);
+    if (cs->num_flows && (!c->flow_hashes || !c->flows[0] || !c->flows[1]))
+        return -ENOMEM;
+
+    memset(&flow, 0, sizeof flow);
+    for (i = 0; i < cs->num_flows; i++) {
+        flow.sip = 0x0a000000 | (churn_random(c) & 0xffffff);
+        flow.sport = htons(1024 + churn_random(c) % 64512);
+        flow.dip = 0xac14ea1a;
+        flow.dport = htons(80);
+        flow.protocol = churn_random(c) & 1 ? 6 : 17;
+        c->flow_hashes[i] = hash(&flow);
+    }
+
+    ret = mh_construct(&c->group);
+    if (ret != 0)
+        return ret;
+    ovsrcu_quiesce();
+
+    return churn_snapshot(c);
+}
+
+static void churn_destroy(struct churn *c)
+{
+    struct ofputil_bucket *bkt, *next;
+
+    mh_destruct(&c->group);
+    ovsrcu_synchronize();
+
+    LIST_FOR_EACH_SAFE (bkt, next, list_node, &c->group.up.buckets) {
+        ovs_list_remove(&bkt->list_node);
+        free(bkt);
+    }
+
+    free(c->disabled);
+    free(c->slot_hashes);
+    free(c->flow_hashes);
+    free(c->slots[0]);
+    free(c->slots[1]);
+    free(c->flows[0]);
+    free(c->flows[1]);
+    free(c->buckets);
+}
+
+/* Prints the lookup counters of the group: the lookups of the snapshots
+ * since the last mh_construct(), which starts them from zero. */
+static void churn_print_stats(struct churn *c)
+{
+    struct mh_stats st;
+    size_t i;
+
+    if (mh_get_stats(&c->group, &st) != 0)
+        return;
+
+    printf("Maglev churn lookups since the last rebuild: %" PRIu64 ", no bucket %" PRIu64 ", fallbacks %" PRIu64 "\n",
+           st.lookups, st.nulls, st.fallbacks);
+    printf("%8s %12s %8s\n", "bucket", "hits", "share");
+    for (i = 0; i < st.n_dests; i++) {
+        printf("%8u %12" PRIu64 " %7.3f%%\n", st.dests[i].dest_id, st.dests[i].hits,
+               st.lookups ? 100.0 * st.dests[i].hits / st.lookups : 0);
+    }
+
+    mh_stats_destroy(&st);
+}
+
+/* Runs the events of 'cs', then 'n_random' random events drawn with 'seed'.
+ * 'hash' computes the hash of the sample flows. The events that do not
+ * apply, e.g. removing a missing bucket, are skipped and counted without
+ * failing the run. With 'count_lookups', the lookups are counted and the
+ * counters printed after the run; they add to the rebuild times otherwise
+ * left out. Returns 0 or a negative errno. */
+int churn_run(const struct churn_script *cs, uint32_t n_random, uint32_t seed, churn_hash_fn *hash,
+              bool count_lookups)
+{
+    struct churn_event ev;
+    struct churn c;
+    double ms;
+    uint32_t i;
+    bool stats;
+    int ret;
+
+    stats = mh_set_stats_enabled(count_lookups);
+
+    ret = churn_init(&c, cs, seed, hash);
+    if (ret) {
+        churn_destroy(&c);
+        mh_set_stats_enabled(stats);
+        return ret;
+    }
+
+    printf("Maglev churn: group=%u, table_size=%u, buckets=%u, weight=%u, flows=%u, max load=%.3f\n",
+           cs->maglev_id, c.table_size, cs->num_buckets, cs->bucket_weight, cs->num_flows, c.max_load);
+    printf("%5s %-8s %8s %6s %6s %9s %10s %10s %10s %7s\n",
+           "event", "op", "bucket", "bkts", "off", "rebuild", "slots", "collat.", "flows", "maxload");
+    printf("%5s %-8s %8s %6s %6s %9s %10s %10s %10s %7s\n",
+           "", "", "", "", "", "ms", "moved", "moved", "moved", "");
+
+    for (i = 0; i < cs->n_events + n_random; i++) {
+        if (i < cs->n_events)
+            ev = cs->events[i];
+        else
+            churn_random_event(&c, &ev);
+
+        ret = churn_apply(&c, &ev, &ms);
+        if (ret) {
+            VLOG_WARN("churn event %u (%s %u) skipped: %s", i + 1, churn_op_names[ev.op], ev.id, strerror(-ret));
+            c.n_skipped++;
+            ret = 0;
+            continue;
+        }
+
+        ret = churn_snapshot(&c);
+        if (ret)
+            break;
+
+        churn_report(&c, &ev, ms);
+    }
+
+    if (c.n_events) {
+        printf("Maglev churn summary: %u events, %u skipped, rebuild avg %.3f ms max %.3f ms, "
+               "moved avg: slots %.3f%%, collateral %.3f%%, flows %.3f%%\n",
+               c.n_events, c.n_skipped, c.rebuild_ms / c.n_events, c.max_rebuild_ms,
+               c.slots_moved / c.n_events, c.collateral / c.n_events, c.flows_moved / c.n_events);
+    }
+
+    if (count_lookups)
+        churn_print_stats(&c);
+
+    churn_destroy(&c);
+    mh_set_stats_enabled(stats);
+
+    return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef __CHURN_H__
+#define __CHURN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+#include "test_vector.h"
+
+/* Backend churn simulator, see churn.c. */
+
+enum churn_op {
+    CHURN_ADD,          /* add bucket 'id' with 'weight' */
+    CHURN_REMOVE,       /* remove bucket 'id' */
+    CHURN_DISABLE,      /* mark bucket 'id' unavailable */
+    CHURN_ENABLE,       /* mark bucket 'id' available again */
+    CHURN_WEIGHT,       /* set the weight of bucket 'id' */
+};
+
+struct churn_event {
+    enum churn_op   op;
+    uint32_t        id;
+    uint32_t        weight;
+};
+
+struct churn_script {
+    /* group */
+    uint32_t    maglev_hash_table_size_index;
+    uint32_t    table_size;         /* 0: by the index */
+    uint32_t    maglev_id;
+    uint32_t    num_buckets;        /* initial buckets, ids 1..num_buckets */
+    uint32_t    bucket_weight;
+    char        *maglev_hash2;
+
+    uint32_t    num_flows;          /* sample flows */
+
+    struct churn_event  *events;
+    uint32_t            n_events;
+    uint32_t            allocated;
+};
+
+/* Hash of a flow, as computed for the test vectors */
+typedef uint32_t churn_hash_fn(struct tv_entry *flow);
+
+void churn_script_init(struct churn_script *cs);
+int  churn_load_script(struct churn_script *cs, const char *file);
+void churn_script_destroy(struct churn_script *cs);
+int  churn_run(const struct churn_script *cs, uint32_t n_random, uint32_t seed, churn_hash_fn *hash,
+               bool count_lookups);
+
+#endif
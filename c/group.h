@@ -2,6 +2,7 @@
 #define __GROUP__ 
 
 #include "list.h"
+#include "rcu.h"
 #include "maglev_hash.h"
 
 struct ofputil_bucket {
@@ -77,7 +78,8 @@ struct group_dpif {
 	uint32_t hash_basis;                /* Basis for dp_hash. */
 	uint32_t hash_mask;                 /* Used to mask dp_hash (2^N - 1).*/
 	struct ofputil_bucket **hash_map;   /* Map hash values to buckets. */
-	struct maglev_hash_service* mh_svc;
+	uint32_t mh_table_size;				/* Maglev table size, 0: by hash_alg */
+	OVSRCU_TYPE(struct maglev_hash_service *) mh_svc;	/* RCU-protected */
 };
 
 
@@ -2,12 +2,19 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
-#include <smmintrin.h>
 
 #include "hash.h"
 #include "util.h"
 
+/* The SSE4.2 engines are built with target attributes and picked only if
+ * the CPU has SSE4.2, see hash_set_engine(). */
+#if defined(__x86_64__)
+#define HASH_HAVE_SSE42 1
+#include <nmmintrin.h>
+#endif
+
 //////////////////////////////
 
 /* The CRC32 polynomial used by the SSE4.2 hardware instruction (CRC-32C, Castagnoli) */
@@ -89,6 +96,9 @@ uint32_t hash_bytes1(const void *p_, size_t n, uint32_t basis)
 /* Precomputed table for byte-by-byte CRC calculation */
 uint32_t crc32c_table[256];
 
+static void swtab_init_crc32c_slice8(void);
+static void swtab_init_crc32c_ipv4(void);
+
 void swtab_init_crc32c() {
     for (uint32_t i = 0; i < 256; ++i) {
         uint32_t crc = i;
@@ -101,6 +111,9 @@ void swtab_init_crc32c() {
         }
         crc32c_table[i] = crc;
     }
+
+    swtab_init_crc32c_slice8();
+    swtab_init_crc32c_ipv4();
 }
 
 uint32_t swtab_crc32c_u32(uint32_t crc, uint32_t v) {
@@ -163,6 +176,177 @@ uint32_t hash_bytes2(const void *p_, size_t n, uint32_t basis)
     return hash_finish2(hash, orig_n);
 }
 
+///////////////////////////////////////
+// with slicing-by-8 tables
+//
+// Same CRC as hash_add1/hash_add2, 8 bytes (or 4) per step:
+// crc32c_slice8[k][i] is the CRC of byte i followed by k zero bytes, so
+// the bytes of a step are looked up independently and xor'ed together.
+// The words are taken as values, like hash_add1 does, so the result is the
+// same as hash_bytes() whatever the byte order of the host.
+uint32_t crc32c_slice8[8][256];
+
+static void swtab_init_crc32c_slice8(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        crc32c_slice8[0][i] = crc32c_table[i];
+    }
+    for (uint32_t k = 1; k < 8; ++k) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = crc32c_slice8[k - 1][i];
+            crc32c_slice8[k][i] = (crc >> 8) ^ crc32c_table[crc & 0xff];
+        }
+    }
+}
+
+static inline uint32_t swtab8_crc32c_u32(uint32_t crc, uint32_t v)
+{
+    crc ^= v;
+    return crc32c_slice8[3][crc & 0xff] ^ crc32c_slice8[2][(crc >> 8) & 0xff] ^
+           crc32c_slice8[1][(crc >> 16) & 0xff] ^ crc32c_slice8[0][crc >> 24];
+}
+
+/* CRC of 'lo' then 'hi' */
+static inline uint32_t swtab8_crc32c_2u32(uint32_t crc, uint32_t lo, uint32_t hi)
+{
+    crc ^= lo;
+    return crc32c_slice8[7][crc & 0xff] ^ crc32c_slice8[6][(crc >> 8) & 0xff] ^
+           crc32c_slice8[5][(crc >> 16) & 0xff] ^ crc32c_slice8[4][crc >> 24] ^
+           crc32c_slice8[3][hi & 0xff] ^ crc32c_slice8[2][(hi >> 8) & 0xff] ^
+           crc32c_slice8[1][(hi >> 16) & 0xff] ^ crc32c_slice8[0][hi >> 24];
+}
+
+uint32_t hash_add3(uint32_t hash, uint32_t data)
+{
+    return swtab8_crc32c_u32(hash, data);
+}
+
+uint32_t hash_finish3(uint64_t hash, uint64_t final)
+{
+    /* The finishing multiplier 0x805204f3 has been experimentally
+     * derived to pass the testsuite hash tests. */
+    hash = swtab8_crc32c_2u32(hash, final, final >> 32) * 0x805204f3;
+    return hash ^ (uint32_t)hash >> 16; /* Increase entropy in LSBs. */
+}
+
+uint32_t hash_bytes3(const void *p_, size_t n, uint32_t basis)
+{
+    const uint8_t *p = p_;
+    size_t orig_n = n;
+    uint32_t hash;
+
+    hash = basis;
+    while (n >= 8) {
+        hash = swtab8_crc32c_2u32(hash,
+                                  get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p)),
+                                  get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p + 4)));
+        n -= 8;
+        p += 8;
+    }
+
+    if (n >= 4) {
+        hash = hash_add3(hash, get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p)));
+        n -= 4;
+        p += 4;
+    }
+
+    if (n) {
+        uint32_t tmp = 0;
+        memcpy(&tmp, p, n);
+        hash = hash_add3(hash, tmp);
+    }
+
+    return hash_finish3(hash, orig_n);
+}
+
+static uint32_t hash_bytes36_slice8(const void *p_, uint32_t basis)
+{
+    const uint8_t *p = p_;
+    uint32_t hash = basis;
+    int i;
+
+    for (i = 0; i < 32; i += 8) {
+        hash = swtab8_crc32c_2u32(hash,
+                                  get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p + i)),
+                                  get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p + i + 4)));
+    }
+    hash = hash_add3(hash, get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p + 32)));
+
+    return hash_finish3(hash, 36);
+}
+
+///////////////////////////////////////
+// IPv4 flow keys by CRC linearity
+//
+// Without the initial and final inversions this CRC is linear: the CRC
+// of a ^ b is the CRC of a ^ the CRC of b, the basis included. For a
+// 36-byte key whose only non-zero words are the IPv4 address (bytes 16 to
+// 19) and the port (bytes 32 to 35), the value hash_finish() multiplies
+// is then a constant ^ the contribution of each byte of the basis, the
+// address and the port word, looked up in tables built once. No CRC chain
+// runs per key and the 28 zero bytes cost nothing.
+static uint32_t crc32c_ipv4_zero;               /* of an all-zero key */
+static uint32_t crc32c_ipv4_tab[3][4][256];     /* basis, address, port word */
+
+/* hash_bytes36() of such a key up to the multiply, by slicing-by-8 */
+static uint32_t crc32c_ipv4_ref(uint32_t basis, uint32_t addr, uint32_t port)
+{
+    uint32_t hash = basis;
+
+    hash = swtab8_crc32c_2u32(hash, 0, 0);
+    hash = swtab8_crc32c_2u32(hash, 0, 0);
+    hash = swtab8_crc32c_2u32(hash, addr, 0);
+    hash = swtab8_crc32c_2u32(hash, 0, 0);
+    hash = swtab8_crc32c_u32(hash, port);
+
+    return swtab8_crc32c_2u32(hash, 36, 0);
+}
+
+static void swtab_init_crc32c_ipv4(void)
+{
+    uint32_t in[3];
+
+    crc32c_ipv4_zero = crc32c_ipv4_ref(0, 0, 0);
+
+    for (int f = 0; f < 3; ++f) {
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                in[0] = in[1] = in[2] = 0;
+                in[f] = i << (k * 8);
+                crc32c_ipv4_tab[f][k][i] = crc32c_ipv4_ref(in[0], in[1], in[2]) ^ crc32c_ipv4_zero;
+            }
+        }
+    }
+}
+
+static inline uint32_t crc32c_ipv4_field(int f, uint32_t v)
+{
+    return crc32c_ipv4_tab[f][0][v & 0xff] ^ crc32c_ipv4_tab[f][1][(v >> 8) & 0xff] ^
+           crc32c_ipv4_tab[f][2][(v >> 16) & 0xff] ^ crc32c_ipv4_tab[f][3][v >> 24];
+}
+
+/* The word of bytes 32 to 35 of the key, as hash_bytes() loads it */
+static inline uint32_t hash_port_word(uint16_t tp_port)
+{
+    uint16_t port[2] = { tp_port, 0 };
+    uint32_t word;
+
+    memcpy(&word, port, sizeof word);
+    return word;
+}
+
+static uint32_t hash_bytes36_ipv4_tab(uint32_t addr, uint16_t tp_port, uint32_t basis)
+{
+    uint64_t hash;
+
+    hash = crc32c_ipv4_zero ^ crc32c_ipv4_field(0, basis) ^ crc32c_ipv4_field(1, addr) ^
+           crc32c_ipv4_field(2, hash_port_word(tp_port));
+
+    /* as hash_finish() does */
+    hash *= 0x805204f3;
+    return hash ^ (uint32_t)hash >> 16;
+}
+
 ///////////////////////////////////////
 // with table reflected
 uint32_t crc32c_table_ref[256];
@@ -185,9 +369,11 @@ uint32_t crc32c_ref(uint32_t crc, const unsigned char *buf, size_t len) {
     return ~crc;
 }
 
+#if defined(HASH_HAVE_SSE42)
 ////////////////////////
 // with sse4.2 reflected
 
+__attribute__((target("sse4.2")))
 uint32_t crc32c_hw_ref(uint32_t crc, const unsigned char *buf, size_t len) {
     //uint32_t crc = 0xFFFFFFFF; // 초기값 (Reflected)
     crc = ~crc;
@@ -210,14 +396,16 @@ uint32_t crc32c_hw_ref(uint32_t crc, const unsigned char *buf, size_t len) {
 /////////////////////////////////////////
 /// _mm_crc32_u32는 crc32c reflected 구현체와 다르다.
 
-uint32_t hash_add(uint32_t hash, uint32_t data)
+__attribute__((target("sse4.2")))
+static uint32_t hash_add_sse42(uint32_t hash, uint32_t data)
 {
     // CRC32C와 다르다. _mm_crc32_u32: non-inverted
     return _mm_crc32_u32(hash, data);
 }
 
 // unsigned __int64 _mm_crc32_u64(unsigned __int64 crc, unsigned __int64 data)
-uint32_t hash_finish(uint64_t hash, uint64_t final)
+__attribute__((target("sse4.2")))
+static uint32_t hash_finish_sse42(uint64_t hash, uint64_t final)
 {
     /* The finishing multiplier 0x805204f3 has been experimentally
      * derived to pass the testsuite hash tests. */
@@ -225,7 +413,8 @@ uint32_t hash_finish(uint64_t hash, uint64_t final)
     return hash ^ (uint32_t)hash >> 16; /* Increase entropy in LSBs. */
 }
 
-uint32_t hash_bytes(const void *p_, size_t n, uint32_t basis)
+__attribute__((target("sse4.2")))
+static uint32_t hash_bytes_sse42(const void *p_, size_t n, uint32_t basis)
 {
     const uint8_t *p = p_;
     size_t orig_n = n;
@@ -233,7 +422,7 @@ uint32_t hash_bytes(const void *p_, size_t n, uint32_t basis)
 
     hash = basis;
     while (n >= 4) {
-        hash = hash_add(hash, get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p)));
+        hash = hash_add_sse42(hash, get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p)));
         n -= 4;
         p += 4;
     }
@@ -242,9 +431,396 @@ uint32_t hash_bytes(const void *p_, size_t n, uint32_t basis)
         uint32_t tmp = 0;
 
         memcpy(&tmp, p, n);
-        hash = hash_add(hash, tmp);
+        hash = hash_add_sse42(hash, tmp);
+    }
+
+    return hash_finish_sse42(hash, orig_n);
+}
+
+/* Same as hash_bytes_sse42(), 8 bytes per crc32 instruction: on x86 the
+ * CRC of a little-endian u64 is the CRC of its two u32 halves in turn. */
+__attribute__((target("sse4.2")))
+static uint32_t hash_bytes_sse42_u64(const void *p_, size_t n, uint32_t basis)
+{
+    const uint8_t *p = p_;
+    size_t orig_n = n;
+    uint64_t hash;
+
+    hash = basis;
+    while (n >= 8) {
+        uint64_t data;
+
+        memcpy(&data, p, sizeof data);
+        hash = _mm_crc32_u64(hash, data);
+        n -= 8;
+        p += 8;
+    }
+
+    if (n >= 4) {
+        hash = hash_add_sse42(hash, get_unaligned_u32(ALIGNED_CAST(const uint32_t *, p)));
+        n -= 4;
+        p += 4;
+    }
+
+    if (n) {
+        uint32_t tmp = 0;
+
+        memcpy(&tmp, p, n);
+        hash = hash_add_sse42(hash, tmp);
+    }
+
+    return hash_finish_sse42(hash, orig_n);
+}
+
+static uint32_t hash_bytes36_sse42(const void *p_, uint32_t basis)
+{
+    return hash_bytes_sse42(p_, 36, basis);
+}
+
+/* hash_bytes_sse42_u64() of 36 bytes, unrolled */
+__attribute__((target("sse4.2")))
+static uint32_t hash_bytes36_sse42_u64(const void *p_, uint32_t basis)
+{
+    const uint8_t *p = p_;
+    uint64_t hash = basis;
+    uint64_t data[4];
+    uint32_t tail;
+
+    memcpy(data, p, sizeof data);
+    memcpy(&tail, p + 32, sizeof tail);
+
+    hash = _mm_crc32_u64(hash, data[0]);
+    hash = _mm_crc32_u64(hash, data[1]);
+    hash = _mm_crc32_u64(hash, data[2]);
+    hash = _mm_crc32_u64(hash, data[3]);
+    hash = _mm_crc32_u32(hash, tail);
+
+    return hash_finish_sse42(hash, 36);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint64_t hash_crc64_at(uint64_t hash, const uint8_t *p)
+{
+    uint64_t data;
+
+    memcpy(&data, p, sizeof data);
+    return _mm_crc32_u64(hash, data);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint64_t hash_crc32_at(uint64_t hash, const uint8_t *p)
+{
+    uint32_t data;
+
+    memcpy(&data, p, sizeof data);
+    return _mm_crc32_u32(hash, data);
+}
+
+/* hash_bytes36_sse42_u64() of 4 keys at a time. The crc32 instruction has
+ * a latency of 3 cycles but issues every cycle, so the independent chains
+ * of the 4 keys are interleaved to keep it busy. */
+__attribute__((target("sse4.2")))
+static void hash_bytes36_batch_sse42_u64(const void *keys, size_t stride, size_t n,
+                                         const uint32_t *bases, uint32_t *hashes)
+{
+    const uint8_t *p0 = keys, *p1, *p2, *p3;
+    uint64_t h0, h1, h2, h3;
+    size_t i;
+    int off;
+
+    for (i = 0; i + 4 <= n; i += 4, p0 += 4 * stride) {
+        p1 = p0 + stride;
+        p2 = p1 + stride;
+        p3 = p2 + stride;
+
+        if (bases) {
+            h0 = bases[i];
+            h1 = bases[i + 1];
+            h2 = bases[i + 2];
+            h3 = bases[i + 3];
+        } else {
+            h0 = h1 = h2 = h3 = 0;
+        }
+
+        for (off = 0; off < 32; off += 8) {
+            h0 = hash_crc64_at(h0, p0 + off);
+            h1 = hash_crc64_at(h1, p1 + off);
+            h2 = hash_crc64_at(h2, p2 + off);
+            h3 = hash_crc64_at(h3, p3 + off);
+        }
+
+        h0 = hash_crc32_at(h0, p0 + 32);
+        h1 = hash_crc32_at(h1, p1 + 32);
+        h2 = hash_crc32_at(h2, p2 + 32);
+        h3 = hash_crc32_at(h3, p3 + 32);
+
+        hashes[i] = hash_finish_sse42(h0, 36);
+        hashes[i + 1] = hash_finish_sse42(h1, 36);
+        hashes[i + 2] = hash_finish_sse42(h2, 36);
+        hashes[i + 3] = hash_finish_sse42(h3, 36);
+    }
+
+    for (; i < n; i++, p0 += stride) {
+        hashes[i] = hash_bytes36_sse42_u64(p0, bases ? bases[i] : 0);
+    }
+}
+
+/* The key of hash_bytes36_ipv4() needs no memory: its zero words are
+ * zero operands. */
+__attribute__((target("sse4.2")))
+static uint32_t hash_bytes36_ipv4_sse42(uint32_t addr, uint16_t tp_port, uint32_t basis)
+{
+    uint64_t hash = basis;
+
+    hash = _mm_crc32_u64(hash, 0);
+    hash = _mm_crc32_u64(hash, 0);
+    hash = _mm_crc32_u64(hash, addr);   /* the address, 4 zero bytes */
+    hash = _mm_crc32_u64(hash, 0);
+    hash = _mm_crc32_u32(hash, hash_port_word(tp_port));
+
+    return hash_finish_sse42(hash, 36);
+}
+
+/* hash_bytes36_ipv4_sse42() of 4 flows at a time, interleaved */
+__attribute__((target("sse4.2")))
+static void hash_bytes36_ipv4_batch_sse42(const uint32_t *addrs, const uint16_t *ports,
+                                          const uint32_t *bases, size_t n, uint32_t *hashes)
+{
+    uint64_t h0, h1, h2, h3;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        h0 = _mm_crc32_u64(_mm_crc32_u64(bases[i], 0), 0);
+        h1 = _mm_crc32_u64(_mm_crc32_u64(bases[i + 1], 0), 0);
+        h2 = _mm_crc32_u64(_mm_crc32_u64(bases[i + 2], 0), 0);
+        h3 = _mm_crc32_u64(_mm_crc32_u64(bases[i + 3], 0), 0);
+
+        h0 = _mm_crc32_u64(_mm_crc32_u64(h0, addrs[i]), 0);
+        h1 = _mm_crc32_u64(_mm_crc32_u64(h1, addrs[i + 1]), 0);
+        h2 = _mm_crc32_u64(_mm_crc32_u64(h2, addrs[i + 2]), 0);
+        h3 = _mm_crc32_u64(_mm_crc32_u64(h3, addrs[i + 3]), 0);
+
+        hashes[i] = hash_finish_sse42(_mm_crc32_u32(h0, hash_port_word(ports[i])), 36);
+        hashes[i + 1] = hash_finish_sse42(_mm_crc32_u32(h1, hash_port_word(ports[i + 1])), 36);
+        hashes[i + 2] = hash_finish_sse42(_mm_crc32_u32(h2, hash_port_word(ports[i + 2])), 36);
+        hashes[i + 3] = hash_finish_sse42(_mm_crc32_u32(h3, hash_port_word(ports[i + 3])), 36);
     }
 
-    return hash_finish(hash, orig_n);
+    for (; i < n; i++) {
+        hashes[i] = hash_bytes36_ipv4_sse42(addrs[i], ports[i], bases[i]);
+    }
+}
+#else
+uint32_t crc32c_hw_ref(uint32_t crc, const unsigned char *buf, size_t len) {
+    return crc32c_ref(crc, buf, len);
 }
+#endif
+
+/////////////////////////////////////////
+// engine dispatch
+//
+// hash_add/hash_finish/hash_bytes go to the fastest engine of the CPU,
+// chosen before main() runs. All the engines give the same hashes.
+
+static uint32_t hash_bytes36_table(const void *p_, uint32_t basis)
+{
+    return hash_bytes2(p_, 36, basis);
+}
+
+static uint32_t hash_bytes36_bitwise(const void *p_, uint32_t basis)
+{
+    return hash_bytes1(p_, 36, basis);
+}
+
+struct hash_engine_ops {
+    const char  *name;
+    uint32_t    (*add)(uint32_t hash, uint32_t data);
+    uint32_t    (*finish)(uint64_t hash, uint64_t final);
+    uint32_t    (*bytes)(const void *p_, size_t n, uint32_t basis);
+    uint32_t    (*bytes36)(const void *p_, uint32_t basis);
+    void        (*bytes36_batch)(const void *keys, size_t stride, size_t n,
+                                 const uint32_t *bases, uint32_t *hashes);  /* optional */
+    uint32_t    (*bytes36_ipv4)(uint32_t addr, uint16_t tp_port, uint32_t basis);
+    void        (*bytes36_ipv4_batch)(const uint32_t *addrs, const uint16_t *ports,
+                                      const uint32_t *bases, size_t n, uint32_t *hashes); /* optional */
+};
+
+static const struct hash_engine_ops hash_engines[N_HASH_ENGINES] = {
+#if defined(HASH_HAVE_SSE42)
+    [HASH_ENGINE_SSE42_U64] = {
+        .name = "sse4.2-u64", .add = hash_add_sse42, .finish = hash_finish_sse42,
+        .bytes = hash_bytes_sse42_u64, .bytes36 = hash_bytes36_sse42_u64,
+        .bytes36_batch = hash_bytes36_batch_sse42_u64,
+        .bytes36_ipv4 = hash_bytes36_ipv4_sse42,
+        .bytes36_ipv4_batch = hash_bytes36_ipv4_batch_sse42,
+    },
+    [HASH_ENGINE_SSE42] = {
+        .name = "sse4.2", .add = hash_add_sse42, .finish = hash_finish_sse42,
+        .bytes = hash_bytes_sse42, .bytes36 = hash_bytes36_sse42,
+        .bytes36_ipv4 = hash_bytes36_ipv4_sse42,
+    },
+#else
+    [HASH_ENGINE_SSE42_U64] = { .name = "sse4.2-u64" },
+    [HASH_ENGINE_SSE42]     = { .name = "sse4.2" },
+#endif
+    /* the software engines hash IPv4 keys by linearity, see above */
+    [HASH_ENGINE_SLICE8] = {
+        .name = "slice8", .add = hash_add3, .finish = hash_finish3,
+        .bytes = hash_bytes3, .bytes36 = hash_bytes36_slice8,
+        .bytes36_ipv4 = hash_bytes36_ipv4_tab,
+    },
+    [HASH_ENGINE_TABLE] = {
+        .name = "table", .add = hash_add2, .finish = hash_finish2,
+        .bytes = hash_bytes2, .bytes36 = hash_bytes36_table,
+        .bytes36_ipv4 = hash_bytes36_ipv4_tab,
+    },
+    [HASH_ENGINE_BITWISE] = {
+        .name = "bitwise", .add = hash_add1, .finish = hash_finish1,
+        .bytes = hash_bytes1, .bytes36 = hash_bytes36_bitwise,
+        .bytes36_ipv4 = hash_bytes36_ipv4_tab,
+    },
+};
+
+static const struct hash_engine_ops *hash_ops = &hash_engines[HASH_ENGINE_BITWISE];
+static enum hash_engine hash_engine = HASH_ENGINE_BITWISE;
+
+static bool hash_engine_supported(enum hash_engine engine)
+{
+    switch (engine) {
+    case HASH_ENGINE_SSE42_U64:
+    case HASH_ENGINE_SSE42:
+#if defined(HASH_HAVE_SSE42)
+        return __builtin_cpu_supports("sse4.2");
+#else
+        return false;
+#endif
+    case HASH_ENGINE_SLICE8:
+    case HASH_ENGINE_TABLE:
+    case HASH_ENGINE_BITWISE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Binds hash_add/hash_finish/hash_bytes to 'engine', or to the fastest one
+ * of the CPU for HASH_ENGINE_AUTO. Returns -ENOTSUP if the CPU lacks it.
+ * Only to be called while no other thread is hashing, e.g. at startup. */
+int hash_set_engine(enum hash_engine engine)
+{
+    if (engine == HASH_ENGINE_AUTO) {
+        /* the engines are listed fastest first */
+        for (engine = HASH_ENGINE_AUTO + 1; !hash_engine_supported(engine); engine++) {
+            continue;
+        }
+    }
 
+    if (!hash_engine_supported(engine))
+        return -ENOTSUP;
+
+    hash_engine = engine;
+    hash_ops = &hash_engines[engine];
+
+    return 0;
+}
+
+enum hash_engine hash_get_engine(void)
+{
+    return hash_engine;
+}
+
+const char* hash_engine_name(enum hash_engine engine)
+{
+    if (engine == HASH_ENGINE_AUTO)
+        return "auto";
+
+    return engine < N_HASH_ENGINES ? hash_engines[engine].name : "unknown";
+}
+
+/* Returns the engine called 'name', or -EINVAL */
+int hash_engine_from_name(const char *name)
+{
+    int engine;
+
+    if (!strcmp(name, "auto"))
+        return HASH_ENGINE_AUTO;
+
+    for (engine = HASH_ENGINE_AUTO + 1; engine < N_HASH_ENGINES; engine++) {
+        if (!strcmp(name, hash_engines[engine].name))
+            return engine;
+    }
+
+    return -EINVAL;
+}
+
+__attribute__((constructor))
+static void hash_engine_init(void)
+{
+    /* the software engines need their tables */
+    swtab_init_crc32c();
+
+    __builtin_cpu_init();
+    hash_set_engine(HASH_ENGINE_AUTO);
+}
+
+uint32_t hash_add(uint32_t hash, uint32_t data)
+{
+    return hash_ops->add(hash, data);
+}
+
+uint32_t hash_finish(uint64_t hash, uint64_t final)
+{
+    return hash_ops->finish(hash, final);
+}
+
+uint32_t hash_bytes(const void *p_, size_t n, uint32_t basis)
+{
+    return hash_ops->bytes(p_, n, basis);
+}
+
+/* hash_bytes(p_, 36, basis), for the flow key: struct hash_val */
+uint32_t hash_bytes36(const void *p_, uint32_t basis)
+{
+    return hash_ops->bytes36(p_, basis);
+}
+
+/* hash_bytes36() of the 'n' keys at 'keys', 'stride' bytes apart, with the
+ * basis bases[i] for key i (0 if 'bases' is NULL), into hashes[]. */
+void hash_bytes36_batch(const void *keys, size_t stride, size_t n,
+                        const uint32_t *bases, uint32_t *hashes)
+{
+    const uint8_t *p = keys;
+    size_t i;
+
+    if (hash_ops->bytes36_batch) {
+        hash_ops->bytes36_batch(keys, stride, n, bases, hashes);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        hashes[i] = hash_ops->bytes36(p + i * stride, bases ? bases[i] : 0);
+    }
+}
+
+/* hash_bytes36() of a flow key with only the IPv4 address 'addr' and the
+ * port 'tp_port' set, as they are laid out in struct hash_val. */
+uint32_t hash_bytes36_ipv4(uint32_t addr, uint16_t tp_port, uint32_t basis)
+{
+    return hash_ops->bytes36_ipv4(addr, tp_port, basis);
+}
+
+/* hash_bytes36_ipv4() of the 'n' flows addrs[i], ports[i], bases[i] */
+void hash_bytes36_ipv4_batch(const uint32_t *addrs, const uint16_t *ports,
+                             const uint32_t *bases, size_t n, uint32_t *hashes)
+{
+    size_t i;
+
+    if (hash_ops->bytes36_ipv4_batch) {
+        hash_ops->bytes36_ipv4_batch(addrs, ports, bases, n, hashes);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        hashes[i] = hash_ops->bytes36_ipv4(addrs[i], ports[i], bases[i]);
+    }
+}
@@ -2,11 +2,35 @@
 #define __HASH_H__
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C engines of hash_add/hash_finish/hash_bytes, fastest first.
+ * All give the same hashes; see hash_set_engine(). */
+enum hash_engine {
+    HASH_ENGINE_AUTO,           /* the fastest one of the CPU */
+    HASH_ENGINE_SSE42_U64,      /* crc32 instruction, 8 bytes at a time */
+    HASH_ENGINE_SSE42,          /* crc32 instruction, 4 bytes at a time */
+    HASH_ENGINE_SLICE8,         /* slicing-by-8 tables */
+    HASH_ENGINE_TABLE,          /* one table lookup per byte */
+    HASH_ENGINE_BITWISE,        /* no table */
+    N_HASH_ENGINES
+};
+
+int              hash_set_engine(enum hash_engine engine);
+enum hash_engine hash_get_engine(void);
+const char*      hash_engine_name(enum hash_engine engine);
+int              hash_engine_from_name(const char *name);
 
 void swtab_init_crc32c();
 uint32_t hash_add(uint32_t hash, uint32_t data);
 uint32_t hash_finish(uint64_t hash, uint64_t final);
 uint32_t hash_bytes(const void *p_, size_t n, uint32_t basis);
+uint32_t hash_bytes36(const void *p_, uint32_t basis);
+void     hash_bytes36_batch(const void *keys, size_t stride, size_t n,
+                            const uint32_t *bases, uint32_t *hashes);
+uint32_t hash_bytes36_ipv4(uint32_t addr, uint16_t tp_port, uint32_t basis);
+void     hash_bytes36_ipv4_batch(const uint32_t *addrs, const uint16_t *ports,
+                                 const uint32_t *bases, size_t n, uint32_t *hashes);
 
 uint32_t hash_add1(uint32_t hash, uint32_t data);
 uint32_t hash_finish1(uint64_t hash, uint64_t final);
@@ -16,6 +40,11 @@ uint32_t hash_add2(uint32_t hash, uint32_t data);
 uint32_t hash_finish2(uint64_t hash, uint64_t final);
 uint32_t hash_bytes2(const void *p_, size_t n, uint32_t basis);
 
+/* slicing-by-8, the tables set up by swtab_init_crc32c() */
+uint32_t hash_add3(uint32_t hash, uint32_t data);
+uint32_t hash_finish3(uint64_t hash, uint64_t final);
+uint32_t hash_bytes3(const void *p_, size_t n, uint32_t basis);
+
 void init_table_ref();
 uint32_t crc32c_ref(uint32_t crc, const unsigned char *buf, size_t len);
 uint32_t crc32c_hw_ref(uint32_t crc, const unsigned char *buf, size_t len);
@@ -0,0 +1,492 @@
+/* SIMD batch hashing of flow keys
+ *
+ * jhash and murmur only use 32-bit add, sub, xor, multiply and rotate, so
+ * a batch of equal-length keys is hashed 8 (AVX2) or 16 (AVX-512) keys at
+ * a time, one key per vector lane. The 32-bit words of the keys are
+ * fetched with byte-scaled gathers, the partial word at the end of a key is
+ * assembled per lane so that nothing past a key is read.
+ *
+ * The results are the same as jhash_bytes() and murmurhash() of each key.
+ * The kernels are compiled with target attributes and only picked after
+ * checking the CPU, see hash_batch_set_isa().
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "jhash.h"
+#include "util.h"
+#include "hash_simd.h"
+
+#if defined(__x86_64__)
+#define HASH_HAVE_SIMD_BATCH 1
+#include <immintrin.h>
+#endif
+
+#define HASH_KEY_LEN    36      /* struct hash_val, the flow key */
+
+#define MURMUR_C1       0xcc9e2d51
+#define MURMUR_C2       0x1b873593
+#define MURMUR_N        0xe6546b64
+
+typedef void hash_batch_fn(const void *keys, size_t stride, size_t len, size_t n,
+                           uint32_t basis, uint32_t *hashes);
+
+///////////////////////////////////////////
+// scalar
+
+static void jhash_bytes_batch_scalar(const void *keys, size_t stride, size_t len, size_t n,
+                                     uint32_t basis, uint32_t *hashes)
+{
+    const uint8_t *p = keys;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        hashes[i] = jhash_bytes(p + i * stride, len, basis);
+    }
+}
+
+static void murmurhash_batch_scalar(const void *keys, size_t stride, size_t len, size_t n,
+                                    uint32_t seed, uint32_t *hashes)
+{
+    const uint8_t *p = keys;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        hashes[i] = murmurhash((const char *)p + i * stride, len, seed);
+    }
+}
+
+#if defined(HASH_HAVE_SIMD_BATCH)
+
+/* The word at 'off' of 'key', zero-padded past 'len' */
+static inline uint32_t hash_tail_word(const uint8_t *key, size_t off, size_t len)
+{
+    uint32_t w = 0;
+
+    if (off < len)
+        memcpy(&w, key + off, MIN(len - off, sizeof w));
+
+    return w;
+}
+
+///////////////////////////////////////////
+// AVX2: 8 lanes
+
+#define ROL_AVX2(X, R) _mm256_or_si256(_mm256_slli_epi32(X, R), _mm256_srli_epi32(X, 32 - (R)))
+
+/* Word 'off' of the 8 keys at 'p', 'vidx' their offsets from 'p' */
+__attribute__((target("avx2")))
+static inline __m256i hash_word_avx2(const uint8_t *p, __m256i vidx, size_t stride,
+                                     size_t off, size_t len)
+{
+    uint32_t w[8];
+    int i;
+
+    if (off + 4 <= len)
+        return _mm256_i32gather_epi32((const int *)(p + off), vidx, 1);
+
+    for (i = 0; i < 8; i++) {
+        w[i] = hash_tail_word(p + i * stride, off, len);
+    }
+
+    return _mm256_loadu_si256((const __m256i *)w);
+}
+
+__attribute__((target("avx2")))
+static inline void jhash_mix_avx2(__m256i *a, __m256i *b, __m256i *c)
+{
+    *a = _mm256_sub_epi32(*a, *c); *a = _mm256_xor_si256(*a, ROL_AVX2(*c,  4)); *c = _mm256_add_epi32(*c, *b);
+    *b = _mm256_sub_epi32(*b, *a); *b = _mm256_xor_si256(*b, ROL_AVX2(*a,  6)); *a = _mm256_add_epi32(*a, *c);
+    *c = _mm256_sub_epi32(*c, *b); *c = _mm256_xor_si256(*c, ROL_AVX2(*b,  8)); *b = _mm256_add_epi32(*b, *a);
+    *a = _mm256_sub_epi32(*a, *c); *a = _mm256_xor_si256(*a, ROL_AVX2(*c, 16)); *c = _mm256_add_epi32(*c, *b);
+    *b = _mm256_sub_epi32(*b, *a); *b = _mm256_xor_si256(*b, ROL_AVX2(*a, 19)); *a = _mm256_add_epi32(*a, *c);
+    *c = _mm256_sub_epi32(*c, *b); *c = _mm256_xor_si256(*c, ROL_AVX2(*b,  4)); *b = _mm256_add_epi32(*b, *a);
+}
+
+__attribute__((target("avx2")))
+static inline void jhash_final_avx2(__m256i *a, __m256i *b, __m256i *c)
+{
+    *c = _mm256_xor_si256(*c, *b); *c = _mm256_sub_epi32(*c, ROL_AVX2(*b, 14));
+    *a = _mm256_xor_si256(*a, *c); *a = _mm256_sub_epi32(*a, ROL_AVX2(*c, 11));
+    *b = _mm256_xor_si256(*b, *a); *b = _mm256_sub_epi32(*b, ROL_AVX2(*a, 25));
+    *c = _mm256_xor_si256(*c, *b); *c = _mm256_sub_epi32(*c, ROL_AVX2(*b, 16));
+    *a = _mm256_xor_si256(*a, *c); *a = _mm256_sub_epi32(*a, ROL_AVX2(*c,  4));
+    *b = _mm256_xor_si256(*b, *a); *b = _mm256_sub_epi32(*b, ROL_AVX2(*a, 14));
+    *c = _mm256_xor_si256(*c, *b); *c = _mm256_sub_epi32(*c, ROL_AVX2(*b, 24));
+}
+
+/* Inlined with a constant 'len' for the flow key */
+__attribute__((target("avx2"), always_inline))
+static inline size_t jhash_batch_avx2_(const uint8_t *p, size_t stride, size_t len, size_t n,
+                                       uint32_t basis, uint32_t *hashes)
+{
+    const __m256i vidx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32(stride));
+    __m256i a, b, c;
+    size_t i, off;
+
+    for (i = 0; i + 8 <= n; i += 8, p += 8 * stride) {
+        a = b = c = _mm256_set1_epi32(0xdeadbeef + len + basis);
+
+        for (off = 0; len - off >= 12; off += 12) {
+            a = _mm256_add_epi32(a, hash_word_avx2(p, vidx, stride, off, len));
+            b = _mm256_add_epi32(b, hash_word_avx2(p, vidx, stride, off + 4, len));
+            c = _mm256_add_epi32(c, hash_word_avx2(p, vidx, stride, off + 8, len));
+            jhash_mix_avx2(&a, &b, &c);
+        }
+
+        if (off < len) {
+            a = _mm256_add_epi32(a, hash_word_avx2(p, vidx, stride, off, len));
+            b = _mm256_add_epi32(b, hash_word_avx2(p, vidx, stride, off + 4, len));
+            c = _mm256_add_epi32(c, hash_word_avx2(p, vidx, stride, off + 8, len));
+            jhash_final_avx2(&a, &b, &c);
+        }
+
+        _mm256_storeu_si256((__m256i *)&hashes[i], c);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static void jhash_bytes_batch_avx2(const void *keys, size_t stride, size_t len, size_t n,
+                                   uint32_t basis, uint32_t *hashes)
+{
+    size_t i;
+
+    if (len == HASH_KEY_LEN)
+        i = jhash_batch_avx2_(keys, stride, HASH_KEY_LEN, n, basis, hashes);
+    else
+        i = jhash_batch_avx2_(keys, stride, len, n, basis, hashes);
+
+    jhash_bytes_batch_scalar((const uint8_t *)keys + i * stride, stride, len, n - i, basis, hashes + i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i murmur_k_avx2(__m256i k)
+{
+    k = _mm256_mullo_epi32(k, _mm256_set1_epi32(MURMUR_C1));
+    k = ROL_AVX2(k, 15);
+    return _mm256_mullo_epi32(k, _mm256_set1_epi32(MURMUR_C2));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t murmur_batch_avx2_(const uint8_t *p, size_t stride, size_t len, size_t n,
+                                        uint32_t seed, uint32_t *hashes)
+{
+    const __m256i vidx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32(stride));
+    __m256i h;
+    size_t i, off;
+
+    for (i = 0; i + 8 <= n; i += 8, p += 8 * stride) {
+        h = _mm256_set1_epi32(seed);
+
+        for (off = 0; off + 4 <= len; off += 4) {
+            h = _mm256_xor_si256(h, murmur_k_avx2(hash_word_avx2(p, vidx, stride, off, len)));
+            h = ROL_AVX2(h, 13);
+            h = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(h, 2), h),
+                                 _mm256_set1_epi32(MURMUR_N));
+        }
+
+        if (len & 3)
+            h = _mm256_xor_si256(h, murmur_k_avx2(hash_word_avx2(p, vidx, stride, off, len)));
+
+        h = _mm256_xor_si256(h, _mm256_set1_epi32(len));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x85ebca6b));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0xc2b2ae35));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+        _mm256_storeu_si256((__m256i *)&hashes[i], h);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static void murmurhash_batch_avx2(const void *keys, size_t stride, size_t len, size_t n,
+                                  uint32_t seed, uint32_t *hashes)
+{
+    size_t i;
+
+    if (len == HASH_KEY_LEN)
+        i = murmur_batch_avx2_(keys, stride, HASH_KEY_LEN, n, seed, hashes);
+    else
+        i = murmur_batch_avx2_(keys, stride, len, n, seed, hashes);
+
+    murmurhash_batch_scalar((const uint8_t *)keys + i * stride, stride, len, n - i, seed, hashes + i);
+}
+
+///////////////////////////////////////////
+// AVX-512: 16 lanes
+
+#define ROL_AVX512(X, R) _mm512_rol_epi32(X, R)
+
+__attribute__((target("avx512f")))
+static inline __m512i hash_word_avx512(const uint8_t *p, __m512i vidx, size_t stride,
+                                       size_t off, size_t len)
+{
+    uint32_t w[16];
+    int i;
+
+    if (off + 4 <= len)
+        return _mm512_i32gather_epi32(vidx, p + off, 1);
+
+    for (i = 0; i < 16; i++) {
+        w[i] = hash_tail_word(p + i * stride, off, len);
+    }
+
+    return _mm512_loadu_si512(w);
+}
+
+__attribute__((target("avx512f")))
+static inline void jhash_mix_avx512(__m512i *a, __m512i *b, __m512i *c)
+{
+    *a = _mm512_sub_epi32(*a, *c); *a = _mm512_xor_si512(*a, ROL_AVX512(*c,  4)); *c = _mm512_add_epi32(*c, *b);
+    *b = _mm512_sub_epi32(*b, *a); *b = _mm512_xor_si512(*b, ROL_AVX512(*a,  6)); *a = _mm512_add_epi32(*a, *c);
+    *c = _mm512_sub_epi32(*c, *b); *c = _mm512_xor_si512(*c, ROL_AVX512(*b,  8)); *b = _mm512_add_epi32(*b, *a);
+    *a = _mm512_sub_epi32(*a, *c); *a = _mm512_xor_si512(*a, ROL_AVX512(*c, 16)); *c = _mm512_add_epi32(*c, *b);
+    *b = _mm512_sub_epi32(*b, *a); *b = _mm512_xor_si512(*b, ROL_AVX512(*a, 19)); *a = _mm512_add_epi32(*a, *c);
+    *c = _mm512_sub_epi32(*c, *b); *c = _mm512_xor_si512(*c, ROL_AVX512(*b,  4)); *b = _mm512_add_epi32(*b, *a);
+}
+
+__attribute__((target("avx512f")))
+static inline void jhash_final_avx512(__m512i *a, __m512i *b, __m512i *c)
+{
+    *c = _mm512_xor_si512(*c, *b); *c = _mm512_sub_epi32(*c, ROL_AVX512(*b, 14));
+    *a = _mm512_xor_si512(*a, *c); *a = _mm512_sub_epi32(*a, ROL_AVX512(*c, 11));
+    *b = _mm512_xor_si512(*b, *a); *b = _mm512_sub_epi32(*b, ROL_AVX512(*a, 25));
+    *c = _mm512_xor_si512(*c, *b); *c = _mm512_sub_epi32(*c, ROL_AVX512(*b, 16));
+    *a = _mm512_xor_si512(*a, *c); *a = _mm512_sub_epi32(*a, ROL_AVX512(*c,  4));
+    *b = _mm512_xor_si512(*b, *a); *b = _mm512_sub_epi32(*b, ROL_AVX512(*a, 14));
+    *c = _mm512_xor_si512(*c, *b); *c = _mm512_sub_epi32(*c, ROL_AVX512(*b, 24));
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline size_t jhash_batch_avx512_(const uint8_t *p, size_t stride, size_t len, size_t n,
+                                         uint32_t basis, uint32_t *hashes)
+{
+    const __m512i vidx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                                               8, 9, 10, 11, 12, 13, 14, 15),
+                                            _mm512_set1_epi32(stride));
+    __m512i a, b, c;
+    size_t i, off;
+
+    for (i = 0; i + 16 <= n; i += 16, p += 16 * stride) {
+        a = b = c = _mm512_set1_epi32(0xdeadbeef + len + basis);
+
+        for (off = 0; len - off >= 12; off += 12) {
+            a = _mm512_add_epi32(a, hash_word_avx512(p, vidx, stride, off, len));
+            b = _mm512_add_epi32(b, hash_word_avx512(p, vidx, stride, off + 4, len));
+            c = _mm512_add_epi32(c, hash_word_avx512(p, vidx, stride, off + 8, len));
+            jhash_mix_avx512(&a, &b, &c);
+        }
+
+        if (off < len) {
+            a = _mm512_add_epi32(a, hash_word_avx512(p, vidx, stride, off, len));
+            b = _mm512_add_epi32(b, hash_word_avx512(p, vidx, stride, off + 4, len));
+            c = _mm512_add_epi32(c, hash_word_avx512(p, vidx, stride, off + 8, len));
+            jhash_final_avx512(&a, &b, &c);
+        }
+
+        _mm512_storeu_si512(&hashes[i], c);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static void jhash_bytes_batch_avx512(const void *keys, size_t stride, size_t len, size_t n,
+                                     uint32_t basis, uint32_t *hashes)
+{
+    size_t i;
+
+    if (len == HASH_KEY_LEN)
+        i = jhash_batch_avx512_(keys, stride, HASH_KEY_LEN, n, basis, hashes);
+    else
+        i = jhash_batch_avx512_(keys, stride, len, n, basis, hashes);
+
+    jhash_bytes_batch_scalar((const uint8_t *)keys + i * stride, stride, len, n - i, basis, hashes + i);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i murmur_k_avx512(__m512i k)
+{
+    k = _mm512_mullo_epi32(k, _mm512_set1_epi32(MURMUR_C1));
+    k = ROL_AVX512(k, 15);
+    return _mm512_mullo_epi32(k, _mm512_set1_epi32(MURMUR_C2));
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline size_t murmur_batch_avx512_(const uint8_t *p, size_t stride, size_t len, size_t n,
+                                          uint32_t seed, uint32_t *hashes)
+{
+    const __m512i vidx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                                               8, 9, 10, 11, 12, 13, 14, 15),
+                                            _mm512_set1_epi32(stride));
+    __m512i h;
+    size_t i, off;
+
+    for (i = 0; i + 16 <= n; i += 16, p += 16 * stride) {
+        h = _mm512_set1_epi32(seed);
+
+        for (off = 0; off + 4 <= len; off += 4) {
+            h = _mm512_xor_si512(h, murmur_k_avx512(hash_word_avx512(p, vidx, stride, off, len)));
+            h = ROL_AVX512(h, 13);
+            h = _mm512_add_epi32(_mm512_add_epi32(_mm512_slli_epi32(h, 2), h),
+                                 _mm512_set1_epi32(MURMUR_N));
+        }
+
+        if (len & 3)
+            h = _mm512_xor_si512(h, murmur_k_avx512(hash_word_avx512(p, vidx, stride, off, len)));
+
+        h = _mm512_xor_si512(h, _mm512_set1_epi32(len));
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+        h = _mm512_mullo_epi32(h, _mm512_set1_epi32(0x85ebca6b));
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+        h = _mm512_mullo_epi32(h, _mm512_set1_epi32(0xc2b2ae35));
+        h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+
+        _mm512_storeu_si512(&hashes[i], h);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static void murmurhash_batch_avx512(const void *keys, size_t stride, size_t len, size_t n,
+                                    uint32_t seed, uint32_t *hashes)
+{
+    size_t i;
+
+    if (len == HASH_KEY_LEN)
+        i = murmur_batch_avx512_(keys, stride, HASH_KEY_LEN, n, seed, hashes);
+    else
+        i = murmur_batch_avx512_(keys, stride, len, n, seed, hashes);
+
+    murmurhash_batch_scalar((const uint8_t *)keys + i * stride, stride, len, n - i, seed, hashes + i);
+}
+
+#endif /* HASH_HAVE_SIMD_BATCH */
+
+///////////////////////////////////////////
+// dispatch
+
+static const struct {
+    const char      *name;
+    hash_batch_fn   *jhash;
+    hash_batch_fn   *murmur;
+} hash_batch_isas[N_HASH_BATCH_ISAS] = {
+#if defined(HASH_HAVE_SIMD_BATCH)
+    [HASH_BATCH_AVX512] = { "avx512", jhash_bytes_batch_avx512, murmurhash_batch_avx512 },
+    [HASH_BATCH_AVX2]   = { "avx2", jhash_bytes_batch_avx2, murmurhash_batch_avx2 },
+#else
+    [HASH_BATCH_AVX512] = { "avx512" },
+    [HASH_BATCH_AVX2]   = { "avx2" },
+#endif
+    [HASH_BATCH_SCALAR] = { "scalar", jhash_bytes_batch_scalar, murmurhash_batch_scalar },
+};
+
+static enum hash_batch_isa hash_batch_isa = HASH_BATCH_SCALAR;
+
+static bool hash_batch_isa_supported(enum hash_batch_isa isa)
+{
+    switch (isa) {
+#if defined(HASH_HAVE_SIMD_BATCH)
+    case HASH_BATCH_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    case HASH_BATCH_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    case HASH_BATCH_SCALAR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Makes the batch functions use 'isa', or the widest one of the CPU for
+ * HASH_BATCH_AUTO. Returns -ENOTSUP if the CPU lacks it.
+ * Only to be called while no other thread is hashing, e.g. at startup. */
+int hash_batch_set_isa(enum hash_batch_isa isa)
+{
+    if (isa == HASH_BATCH_AUTO) {
+        /* the instruction sets are listed widest first */
+        for (isa = HASH_BATCH_AUTO + 1; !hash_batch_isa_supported(isa); isa++) {
+            continue;
+        }
+    }
+
+    if (!hash_batch_isa_supported(isa))
+        return -ENOTSUP;
+
+    hash_batch_isa = isa;
+
+    return 0;
+}
+
+enum hash_batch_isa hash_batch_get_isa(void)
+{
+    return hash_batch_isa;
+}
+
+const char* hash_batch_isa_name(enum hash_batch_isa isa)
+{
+    if (isa == HASH_BATCH_AUTO)
+        return "auto";
+
+    return isa < N_HASH_BATCH_ISAS ? hash_batch_isas[isa].name : "unknown";
+}
+
+/* Returns the instruction set called 'name', or -EINVAL */
+int hash_batch_isa_from_name(const char *name)
+{
+    int isa;
+
+    if (!strcmp(name, "auto"))
+        return HASH_BATCH_AUTO;
+
+    for (isa = HASH_BATCH_AUTO + 1; isa < N_HASH_BATCH_ISAS; isa++) {
+        if (!strcmp(name, hash_batch_isas[isa].name))
+            return isa;
+    }
+
+    return -EINVAL;
+}
+
+__attribute__((constructor))
+static void hash_batch_init(void)
+{
+    __builtin_cpu_init();
+    hash_batch_set_isa(HASH_BATCH_AUTO);
+}
+
+void jhash_bytes_batch(const void *keys, size_t stride, size_t len, size_t n,
+                       uint32_t basis, uint32_t *hashes)
+{
+    /* the lanes address the keys with 32-bit offsets */
+    if (stride > INT32_MAX / 16) {
+        jhash_bytes_batch_scalar(keys, stride, len, n, basis, hashes);
+        return;
+    }
+
+    hash_batch_isas[hash_batch_isa].jhash(keys, stride, len, n, basis, hashes);
+}
+
+void murmurhash_batch(const void *keys, size_t stride, size_t len, size_t n,
+                      uint32_t seed, uint32_t *hashes)
+{
+    /* the lanes address the keys with 32-bit offsets */
+    if (stride > INT32_MAX / 16) {
+        murmurhash_batch_scalar(keys, stride, len, n, seed, hashes);
+        return;
+    }
+
+    hash_batch_isas[hash_batch_isa].murmur(keys, stride, len, n, seed, hashes);
+}
@@ -0,0 +1,30 @@
+#ifndef __HASH_SIMD_H__
+#define __HASH_SIMD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Batch jhash and murmur hashing, see hash_simd.c.
+ *
+ * Each hashes the 'n' keys of 'len' bytes at 'keys', 'stride' bytes apart,
+ * into hashes[]: the same as jhash_bytes()/murmurhash() of every key. */
+void jhash_bytes_batch(const void *keys, size_t stride, size_t len, size_t n,
+                       uint32_t basis, uint32_t *hashes);
+void murmurhash_batch(const void *keys, size_t stride, size_t len, size_t n,
+                      uint32_t seed, uint32_t *hashes);
+
+/* Instruction sets of the batch functions, widest first */
+enum hash_batch_isa {
+    HASH_BATCH_AUTO,            /* the widest one of the CPU */
+    HASH_BATCH_AVX512,          /* 16 keys at a time */
+    HASH_BATCH_AVX2,            /* 8 keys at a time */
+    HASH_BATCH_SCALAR,          /* one key at a time */
+    N_HASH_BATCH_ISAS
+};
+
+int                 hash_batch_set_isa(enum hash_batch_isa isa);
+enum hash_batch_isa hash_batch_get_isa(void);
+const char*         hash_batch_isa_name(enum hash_batch_isa isa);
+int                 hash_batch_isa_from_name(const char *name);
+
+#endif
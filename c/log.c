@@ -18,6 +18,9 @@ void my_log_printf(LogLevel level, const char* format, ...) {
         return;
     }
 
+    /* keep the lines of concurrent builds whole */
+    flockfile(stdout);
+
     printf("%s ", log_level_strings[level]);
 
     va_list args;
@@ -26,6 +29,8 @@ void my_log_printf(LogLevel level, const char* format, ...) {
     va_end(args);
 
     printf("\n");
+
+    funlockfile(stdout);
 }
 
 
@@ -9,8 +9,13 @@ typedef enum {
     LOG_LEVEL_COUNT
 } LogLevel;
 
+extern LogLevel current_log_level;
+
 void my_log_printf(LogLevel level, const char* format, ...);
 
+#define VLOG_IS_ENABLED(level)  ((level) <= current_log_level)
+#define VLOG_IS_INFO_ENABLED()  VLOG_IS_ENABLED(LOG_LEVEL_INFO)
+
 #define VLOG_ERROR(format, ...) my_log_printf(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
 #define VLOG_WARN(format, ...)  my_log_printf(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
 #define VLOG_INFO(format, ...)  my_log_printf(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
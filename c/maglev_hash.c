@@ -25,23 +25,38 @@
 
 #include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 
 #include "log.h"
 #include "list.h"
+#include "rcu.h"
 #include "jhash.h"
 #include "hash.h"
 #include "maglev_hash_utils.h"
 #include "maglev_hash.h"
+#include "maglev_hash_pool.h"
+#include "maglev_hash_simd.h"
 #include "group.h"
 
 //VLOG_DEFINE_THIS_MODULE(maglev_hash);
 
 #define CONFIG_MH_TAB_INDEX 5 /* 4093 */
 
-static void mh_reset_state(struct maglev_state *s);
+/* Lookup table sizes selectable by the table size index (group->hash_alg).
+ * [0]     : for debugging
+ * [1 ~ 10]: valid
+ */
+#define MH_PRIMES(X) \
+    X(11) X(251) X(509) X(1021) X(2039) X(4093) X(8191) X(16381) X(32749) X(65521) X(131071)
+
 static int mh_get_dest_count(struct maglev_hash_service *svc);
+static int mh_gcd_weight(struct maglev_hash_service *svc, bool available_only);
+static int mh_shift_weight(struct maglev_hash_service *svc, int gcd, bool available_only);
 uint32_t murmurhash (const char *key, uint32_t len, uint32_t seed);
 
 ///////////////////////////////////////////
@@ -53,6 +68,17 @@ void * xcalloc(size_t count, size_t size)
     return p;
 }
 
+/* Phases of the last build of each thread, see mh_get_build_times() */
+static __thread struct mh_build_times mh_build_times;
+
+static inline uint64_t mh_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static inline uint32_t mh_hash1(uint8_t *data, uint32_t len)
 {
     return hash_bytes(data, len, 0);
@@ -69,21 +95,29 @@ static inline uint32_t mh_mhash2(uint8_t *data, uint32_t len)
 }
 
 static inline uint32_t mh_get_table_size(uint32_t idx) {
-    /* [0]     : for debugging
-     * [1 ~ 10]: valid
-     */
-
-    static uint32_t mh_primes[] = {11, 251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521, 131071};
+#define MH_PRIME_VALUE(SIZE) SIZE,
+    static uint32_t mh_primes[] = { MH_PRIMES(MH_PRIME_VALUE) };
+#undef MH_PRIME_VALUE
 
     uint32_t len = sizeof(mh_primes) / sizeof(mh_primes[0]);
 
-    if (idx > len) {
+    if (idx >= len) {
         idx = CONFIG_MH_TAB_INDEX;
     }
 
     return mh_primes[idx];
 }
 
+/* Returns the table size for a requested 'size': the smallest prime not
+ * below it, capped at MH_TABLE_SIZE_MAX. */
+static uint32_t mh_round_table_size(uint32_t size)
+{
+    if (size >= MH_TABLE_SIZE_MAX)
+        return MH_TABLE_SIZE_MAX;
+
+    return next_prime(size);
+}
+
 /* Helper function to determine if server is unavailable */
 static inline uint32_t is_unavailable(struct maglev_dest *dest)
 {
@@ -95,28 +129,74 @@ static inline uint32_t is_unavailable(struct maglev_dest *dest)
 
 static struct maglev_dest* mh_get_lookup_dest(struct maglev_state *s, unsigned int hash_data)
 {
-    unsigned int hash = hash_data % s->lookup_size;
-    return s->lookup[hash].dest;
+    unsigned int hash = mh_divider_mod(&s->div, hash_data);
+    return s->dests[mh_lookup_index(s, hash)];
+}
+
+/* Number of hashes resolved per stage of the batch lookup. */
+#define MH_LOOKUP_BATCH 32
+
+/* Reference batch kernel: same as mh_get_lookup_dest() for each hash, with
+ * the lookup entries of each chunk prefetched before they are read. */
+static void mh_lookup_kernel_scalar(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                                    struct maglev_dest **dests)
+{
+    uint32_t slots[MH_LOOKUP_BATCH];
+    size_t i, j, cnt;
+
+    for (i = 0; i < n; i += cnt) {
+        cnt = MIN(n - i, MH_LOOKUP_BATCH);
+
+        for (j = 0; j < cnt; j++) {
+            slots[j] = mh_divider_mod(&s->div, hashes[i + j]);
+            OVS_PREFETCH((uint8_t *)s->lookup + slots[j] * mh_lookup_entry_size(s));
+        }
+
+        for (j = 0; j < cnt; j++) {
+            dests[i + j] = s->dests[mh_lookup_index(s, slots[j])];
+        }
+    }
+}
+
+static mh_lookup_kernel_fn* mh_select_lookup_kernel(void)
+{
+#if defined(MH_HAVE_SIMD_KERNELS)
+    if (__builtin_cpu_supports("avx512f"))
+        return mh_lookup_kernel_avx512;
+
+    if (__builtin_cpu_supports("avx2"))
+        return mh_lookup_kernel_avx2;
+#endif
+
+    return mh_lookup_kernel_scalar;
 }
 
-static int mh_permutate(struct maglev_state *s, struct maglev_hash_service *svc)
+/* Minimum number of dests for the permutations to be set up in parallel. */
+#define MH_PERMUTATE_PARALLEL_MIN 4096
+
+struct mh_permutate_job {
+    struct maglev_state         *s;
+    struct maglev_hash_service  *svc;
+    bool                        available_only;
+};
+
+/* Sets dest_setup for share 'idx' of 'n' of the dests permutation */
+static void mh_permutate_range(void *aux, unsigned int idx, unsigned int n)
 {
+    struct mh_permutate_job *job = aux;
+    struct maglev_state *s = job->s;
+    struct maglev_hash_service *svc = job->svc;
+    uint32_t k = (uint64_t)s->n_dests * idx / n;
+    uint32_t end = (uint64_t)s->n_dests * (idx + 1) / n;
     struct maglev_dest_setup *ds;
     struct maglev_dest *dest;
-    int lw;
     uint32_t hash_data = 0;
+    int lw;
 
-    /* If gcd is smaller then 1, number of dests or
-     * all last_weight of dests are zero. So, skip
-     * permutation for the dests.
-     */
-    if (s->gcd < 1)
-        return 0;
-
-    /* Set dest_setup for the dests permutation */
-    ds = &s->dest_setup[0];
-
-    LIST_FOR_EACH (dest, n_list, &svc->destinations) {
+    for (; k < end; k++) {
+        /* dests[] follows the list order, starting from 1 */
+        dest = s->dests[k + 1];
+        ds = &s->dest_setup[k];
         hash_data = dest->dest_id;
 
         if (svc->flags & MH_HASH2_MURMUR) {
@@ -129,29 +209,49 @@ static int mh_permutate(struct maglev_state *s, struct maglev_hash_service *svc)
 
         lw = dest->last_weight;
         ds->turns = ((lw / s->gcd) >> s->rshift) ? : (lw != 0);
-
-        ds++;
+        if (job->available_only && is_unavailable(dest))
+            ds->turns = 0;
     }
+}
+
+/* Sets dest_setup for the population. With 'available_only', unavailable
+ * dests get no turns and are left out of the table. */
+static int mh_permutate(struct maglev_state *s, struct maglev_hash_service *svc, struct mh_pool *pool,
+                        bool available_only)
+{
+    struct mh_permutate_job job = { s, svc, available_only };
+
+    /* If gcd is smaller then 1, number of dests or
+     * all last_weight of dests are zero. So, skip
+     * permutation for the dests.
+     */
+    if (s->gcd < 1)
+        return 0;
+
+    if (s->n_dests < MH_PERMUTATE_PARALLEL_MIN)
+        pool = NULL;
+
+    mh_pool_run(pool, mh_permutate_range, &job);
 
     return 0;
 }
 
-static int mh_populate(struct maglev_state *s, struct maglev_hash_service *svc)
+/* Reference populate engine: walks the dest list and probes the permutation
+ * of each dest one slot at a time. */
+static int mh_populate_list(struct maglev_state *s, struct maglev_hash_service *svc)
 {
     int n, c, dt_count;
     unsigned long *table;
     struct ovs_list *p;
     struct maglev_dest_setup *ds;
-    struct maglev_dest *new_dest;
 
     /* If gcd is smaller then 1, number of dests or
      * all last_weight of dests are zero. So, skip
-     * the population for the dests and reset lookup table.
+     * the population for the dests and leave the new
+     * lookup table empty.
      */
-    if (s->gcd < 1) {
-        mh_reset_state(s);
+    if (s->gcd < 1)
         return 0;
-    }
 
     table =  xcalloc(BITS_TO_LONGS(svc->table_size), sizeof(unsigned long));
     if (!table)
@@ -187,8 +287,8 @@ static int mh_populate(struct maglev_state *s, struct maglev_hash_service *svc)
 
             set_bit(c, table);
 
-            new_dest = CONTAINER_OF(p, struct maglev_dest, n_list);
-            s->lookup[c].dest =  new_dest;
+            /* dests[] follows the list order, starting from 1 */
+            mh_set_lookup_index(s, c, ds - s->dest_setup + 1);
 
             if (++n == svc->table_size)
                 goto out;
@@ -206,276 +306,853 @@ out:
     return 0;
 }
 
-/* Get maglev_dest associated with supplied parameters. */
-static struct maglev_dest* mh_lookup_dest(struct maglev_state *s,  uint32_t hash_data)
+/* Fast populate engine
+ *
+ * Fills the same table as mh_populate_list(): in each round the dests take
+ * turns in list order, each one claiming 'turns' slots, and every claim is
+ * the first free slot on the dest's permutation from its current position.
+ *
+ * The permutation state of the dests that take slots is kept in contiguous
+ * arrays and the taken slots in a bitmap of 64-bit words, so a round is a
+ * linear pass over the arrays. The claims of one dest in a round are probed
+ * in a row with its position and skip kept in registers.
+ *
+ * Near the end, probing costs about table_size / free steps per claim. The
+ * table size being prime, the number of steps from position p to slot f on a
+ * permutation is ((f - p) * skip^-1) mod table_size, so once few slots are
+ * left the claim is found instead as the free slot with the fewest steps, by
+ * a scan of the list of free slots.
+ */
+
+/* Cost of scanning one free slot relative to one probe of the bitmap. */
+#define MH_POPULATE_DENSE_COST 4
+
+/* Returns the number of free slots under which the dense tail is cheaper:
+ * the largest 'f' with f * f * MH_POPULATE_DENSE_COST <= 'size'. */
+static uint32_t mh_populate_dense_tail(uint32_t size)
 {
-    if (!s) {
-        return NULL;
-    }
+    uint32_t f = 0;
 
-    struct maglev_dest *dest = mh_get_lookup_dest(s, hash_data);
+    while ((uint64_t)(f + 1) * (f + 1) * MH_POPULATE_DENSE_COST <= size)
+        f++;
 
-    return (!dest || is_unavailable(dest)) ? NULL : dest;
+    return f;
 }
 
-/* As mh_lookup_dest, but with fallback if selected server is unavailable */
-static inline struct maglev_dest *mh_lookup_dest_fallback(struct maglev_state *s, uint32_t hash_data)
+/* Returns a * b mod m for a, b < m, with mu = UINT64_MAX / m (Barrett). */
+static inline uint32_t mh_mulmod(uint32_t a, uint32_t b, uint32_t m, uint64_t mu)
 {
-    unsigned int offset, roffset;
-    unsigned int hash;
-    struct maglev_dest *dest;
-
-    if (!s) {
-        return NULL;
-    }
+    uint64_t x = (uint64_t)a * b;
+    uint64_t r = x - (uint64_t)(((unsigned __int128)x * mu) >> 64) * m;
 
-    /* First try the dest it's supposed to go to */
-    dest = mh_get_lookup_dest(s, hash_data);
-    if (!dest)
-        return NULL;
+    return r >= m ? r - m : r;
+}
 
-    if (!is_unavailable(dest))
-        return dest;
+/* Next position on a permutation. Written for a conditional move: whether
+ * it wraps around is random, a branch on it would be mispredicted half of the
+ * time. */
+static inline uint32_t mh_perm_next(uint32_t c, uint32_t skip, uint32_t size)
+{
+    uint32_t back = size - skip;
 
-    VLOG_INFO("selected unavailable server(id=%u:%u), reselecting", dest->gid, dest->dest_id);
+    return c >= back ? c - back : c + skip;
+}
 
-    /* If the original dest is unavailable, loop around the table
-     * starting from ihash to find a new dest
-     */
-    for (offset = 0; offset < s->lookup_size; offset++) {
-        /* XXX: FIXME from ipvs code */
-        roffset = offset + hash_data;
-        hash = mh_hash1((uint8_t*)&roffset, sizeof(roffset));
-        dest = mh_get_lookup_dest(s, hash);
-        if (!dest)
-            break;
-
-        if (!is_unavailable(dest))
-            return dest;
+/* Working state of the fast and parallel engines. The arrays hold the dests
+ * that take slots, in list order. */
+struct mh_populate {
+    struct maglev_state *s;
+    uint32_t    size;
+    uint32_t    n_active;
+    uint32_t    *perm;      /* next position on the permutation */
+    uint32_t    *skip;
+    uint32_t    *turns;
+    uint32_t    *idx;       /* dests[] index */
+    uint32_t    *inv;       /* skip^-1 mod size, 0 until needed */
+    uint32_t    *first;     /* [d]: claims of dests before 'd' in a round */
+    uint64_t    *taken;     /* claimed slots */
+    uint32_t    n;          /* number of claimed slots */
+    uint32_t    i;          /* dest whose turn it is */
+    uint32_t    t;          /* claims of dest 'i' in this round */
+};
+
+static inline bool mh_populate_taken(const struct mh_populate *p, uint32_t c)
+{
+    return p->taken[c / 64] & (1ULL << (c % 64));
+}
 
-        VLOG_INFO("selected unavailable server(id=%u:%u) (offset %u), reselecting", dest->gid, dest->dest_id, roffset);
-    }
+static inline void mh_populate_claim(struct mh_populate *p, uint32_t c, uint32_t d)
+{
+    p->taken[c / 64] |= 1ULL << (c % 64);
+    mh_set_lookup_index(p->s, c, p->idx[d]);
+    p->n++;
+}
 
-    return NULL;
+static void mh_populate_fini(struct mh_populate *p)
+{
+    free(p->taken);
+    free(p->perm);
 }
 
-/* Assign all the hash buckets of the specified table with the service. */
-static int mh_build_lookup_table(struct maglev_state *s, struct maglev_hash_service *svc)
+static int mh_populate_init(struct mh_populate *p, struct maglev_state *s, struct maglev_hash_service *svc)
 {
-    int ret=0;
-    int num_dests = mh_get_dest_count(svc);
+    struct maglev_dest_setup *ds;
+    uint32_t d = 0;
 
-    if (num_dests > svc->table_size)
-        return -EINVAL;
+    memset(p, 0, sizeof *p);
+    p->s = s;
+    p->size = svc->table_size;
 
-    if (num_dests >= 1) {
-        s->dest_setup = xcalloc(num_dests, sizeof(struct maglev_dest_setup));
-        if (!s->dest_setup)
-            return -ENOMEM;
+    p->perm = xcalloc(6 * s->n_dests + 1, sizeof(uint32_t));
+    p->taken = xcalloc(DIV_ROUND_UP(p->size, 64), sizeof(uint64_t));
+    if (!p->perm || !p->taken) {
+        mh_populate_fini(p);
+        return -ENOMEM;
     }
 
-    mh_permutate(s, svc);
-    ret = mh_populate(s, svc);
+    p->skip = p->perm + s->n_dests;
+    p->turns = p->skip + s->n_dests;
+    p->idx = p->turns + s->n_dests;
+    p->inv = p->idx + s->n_dests;
+    p->first = p->inv + s->n_dests;
 
-    if (s->dest_setup) {
-        free(s->dest_setup);
-        s->dest_setup = NULL;
+    for (ds = s->dest_setup; ds < s->dest_setup + s->n_dests; ds++) {
+        /* Ignore added server with zero weight */
+        if (ds->turns < 1)
+            continue;
+
+        p->perm[d] = ds->perm;
+        p->skip[d] = ds->skip;
+        p->turns[d] = ds->turns;
+        /* dests[] follows the list order, starting from 1 */
+        p->idx[d] = ds - s->dest_setup + 1;
+        p->first[d + 1] = p->first[d] + ds->turns;
+        d++;
     }
+    p->n_active = d;
 
-    return ret;
+    return 0;
 }
 
-static int mh_gcd_weight(struct maglev_hash_service *svc)
+/* Claims slots by probing until 'stop' slots are taken, a dest at a time:
+ * the switch happens at the end of a dest's claims of the round. */
+static void mh_populate_probe(struct mh_populate *p, uint32_t stop)
 {
-    struct maglev_dest *dest;
-    int weight;
-    int g = 0;
+    uint32_t i = p->i, j, c, sk, cnt;
 
-    LIST_FOR_EACH(dest, n_list, &svc->destinations) {
-        weight = dest->last_weight;
-        if (weight > 0) {
-            if (g > 0)
-                g = gcd(weight, g);
-            else
-                g = weight;
+    while (p->n < stop) {
+        c = p->perm[i];
+        sk = p->skip[i];
+        cnt = MIN(p->turns[i] - p->t, p->size - p->n);
+
+        for (j = 0; j < cnt; j++) {
+            /* find the available slot */
+            while (mh_populate_taken(p, c))
+                c = mh_perm_next(c, sk, p->size);
+
+            mh_populate_claim(p, c, i);
+
+            /* 'c' is taken now, resume after it */
+            c = mh_perm_next(c, sk, p->size);
         }
+
+        p->perm[i] = c;
+        p->t = 0;
+
+        if (++i == p->n_active)
+            i = 0;
     }
 
-    return g;
+    p->i = i;
 }
 
-/* To avoid assigning huge weight for the MH table,
- * calculate shift value with gcd.
- */
-static int mh_shift_weight(struct maglev_hash_service *svc, int gcd)
+/* Claims the remaining slots, picking for each claim the free slot with the
+ * fewest steps on the permutation. */
+static int mh_populate_dense(struct mh_populate *p)
 {
-    struct maglev_dest *dest;
-    int new_weight, weight = 0;
-    int mw, shift;
+    const uint32_t size = p->size;
+    const uint64_t mu = UINT64_MAX / size;
+    uint32_t i = p->i, n_free = 0, j, c, x0, k, best, best_j;
+    uint32_t *free_slots;
+    uint64_t bits;
 
-    /* If gcd is smaller then 1, number of dests or
-     * all last_weight of dests are zero. So, return
-     * shift value as zero.
-     */
-    if (gcd < 1)
+    if (p->n == size)
         return 0;
 
-    LIST_FOR_EACH(dest, n_list, &svc->destinations) {
-        new_weight = dest->last_weight;
-        if (new_weight > weight)
-            weight = new_weight;
+    free_slots = xcalloc(size - p->n, sizeof(uint32_t));
+    if (!free_slots)
+        return -ENOMEM;
+
+    for (j = 0; j < DIV_ROUND_UP(size, 64); j++) {
+        bits = ~p->taken[j];
+        while (bits) {
+            c = j * 64 + __builtin_ctzll(bits);
+            if (c >= size)
+                break;
+
+            free_slots[n_free++] = c;
+            bits &= bits - 1;
+        }
     }
 
-    /* Because gcd is greater than zero,
-     * the maximum weight and gcd are always greater than zero
-     */
-    mw = weight / gcd;
+    while (n_free) {
+        /* only the few dests claiming here need the inverse */
+        if (!p->inv[i])
+            p->inv[i] = inverse_mod(p->skip[i], size);
+
+        best_j = 0;
+        if (p->inv[i]) {
+            x0 = mh_mulmod(p->perm[i], p->inv[i], size, mu);
+            best = UINT32_MAX;
+
+            for (j = 0; j < n_free; j++) {
+                k = mh_mulmod(free_slots[j], p->inv[i], size, mu);
+                k = k >= x0 ? k - x0 : k + size - x0;
+                if (k < best) {
+                    best = k;
+                    best_j = j;
+                }
+            }
+        } else {
+            /* the table size is not prime: probe */
+            c = p->perm[i];
+            while (mh_populate_taken(p, c))
+                c = mh_perm_next(c, p->skip[i], size);
 
-    int tab_bits = bitlen(svc->table_size)/2;
+            while (free_slots[best_j] != c)
+                best_j++;
+        }
 
-    /* shift = occupied bits of weight/gcd - MH highest bits */
-    shift = fls(mw) - tab_bits;
-    return (shift >= 0) ? shift : 0;
+        c = free_slots[best_j];
+        free_slots[best_j] = free_slots[--n_free];
+
+        mh_populate_claim(p, c, i);
+        p->perm[i] = mh_perm_next(c, p->skip[i], size);
+
+        if (++p->t >= p->turns[i]) {
+            p->t = 0;
+            if (++i == p->n_active)
+                i = 0;
+        }
+    }
+
+    p->i = i;
+    free(free_slots);
+    return 0;
 }
 
-static struct maglev_state* mh_alloc_state(uint32_t table_size)
+static int mh_populate_fast(struct maglev_state *s, struct maglev_hash_service *svc)
 {
-    struct maglev_state *s;
+    struct mh_populate p;
+    int ret;
 
-    /* Allocate the MH table for this service */
-    s = xcalloc(1, sizeof(struct maglev_state));
-    if (!s)
-        return NULL;
+    /* If gcd is smaller then 1, number of dests or
+     * all last_weight of dests are zero. So, skip
+     * the population for the dests and leave the new
+     * lookup table empty.
+     */
+    if (s->gcd < 1)
+        return 0;
 
-    s->lookup = xcalloc(table_size, sizeof(struct maglev_lookup));
-    if (!s->lookup) {
-        free(s);
-        return NULL;
-    }
+    ret = mh_populate_init(&p, s, svc);
+    if (ret < 0)
+        return ret;
 
-    s->lookup_size = table_size;
+    mh_populate_probe(&p, p.size - mh_populate_dense_tail(p.size));
+    ret = mh_populate_dense(&p);
+
+    mh_populate_fini(&p);
+    return ret;
+}
+
+/* Parallel populate engine
+ *
+ * Runs the fast engine with the bulk of the probing spread over a worker
+ * pool, filling the same table. The claims are processed in windows of
+ * consecutive claims of the round-robin order, each taking about 1/8 of the
+ * free slots:
+ *
+ * - speculation, in parallel: on the bitmap as it is at the start of the
+ *   window, every dest of the window lists the free slots its claims of the
+ *   window would take, i.e. the next free slots on its permutation;
+ * - commit, in the round-robin order: each claim takes the first slot of
+ *   the dest's list that is still free. Claims only add taken slots, so the
+ *   positions skipped by the speculation are still taken and that slot is
+ *   the one sequential probing would find. Once a dest's list is used up,
+ *   it probes on from its last listed slot.
+ *
+ * The window size keeps the lists mostly valid, and the probing work of a
+ * window, about table_size / 8 steps, large enough to pay for the dispatch.
+ * The last free slots are left to the sequential probing and dense tail.
+ */
 
-    /* refcnt starts 1 */
-    //ovs_refcount_init(&s->refcnt);
-    s->refcnt = 1;
+/* Minimum table size for the parallel engine */
+#define MH_POPULATE_PARALLEL_MIN 32768
 
-    VLOG_INFO("Alloc Maglev State: state=%p, lookup_size=%u", s, table_size);
+/* Free slots under which the rest is done sequentially */
+#define MH_POPULATE_PARALLEL_MIN_FREE 4096
 
-    return s;
+struct mh_populate_window {
+    struct mh_populate  *p;
+    uint32_t            d0, d1;     /* dests of the window */
+    uint32_t            rounds;     /* rounds, if all dests */
+    uint32_t            *cand;      /* slots listed for dest d, from
+                                     * rounds * (first[d] - first[d0]) */
+    uint32_t            *used;      /* [d]: listed slots consumed */
+};
+
+/* Returns the first dest 'd' in [lo, hi] with first[d] >= 'claim', or
+ * hi + 1. */
+static uint32_t mh_populate_find(const struct mh_populate *p, uint32_t lo, uint32_t hi, uint32_t claim)
+{
+    uint32_t mid;
+
+    hi++;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (p->first[mid] < claim)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
 }
 
-static void mh_init_state(struct maglev_state *s, struct maglev_hash_service *svc)
+static void mh_populate_speculate(void *aux, unsigned int idx, unsigned int n)
 {
-    s->gcd = mh_gcd_weight(svc);
-    s->rshift = mh_shift_weight(svc, s->gcd);
+    struct mh_populate_window *w = aux;
+    const struct mh_populate *p = w->p;
+    uint32_t base = p->first[w->d0];
+    uint64_t total = p->first[w->d1] - base;
+    uint32_t d = mh_populate_find(p, w->d0, w->d1, base + total * idx / n);
+    uint32_t end = mh_populate_find(p, w->d0, w->d1, base + total * (idx + 1) / n);
+    uint32_t *cand, need, k, c, sk;
+
+    for (; d < end; d++) {
+        cand = w->cand + w->rounds * (p->first[d] - base);
+        need = w->rounds * p->turns[d];
+        c = p->perm[d];
+        sk = p->skip[d];
+
+        for (k = 0; k < need; k++) {
+            while (mh_populate_taken(p, c))
+                c = mh_perm_next(c, sk, p->size);
+
+            cand[k] = c;
+            c = mh_perm_next(c, sk, p->size);
+        }
+    }
 }
 
-/* Reset all the hash buckets of the specified table. */
-static void mh_reset_state(struct maglev_state *s)
+static void mh_populate_commit(struct mh_populate_window *w)
 {
-    int i;
+    struct mh_populate *p = w->p;
+    uint32_t base = p->first[w->d0];
+    uint32_t r, d, t, c, need, *cand;
 
-    if (!s || !s->lookup) {
-        return;
+    for (d = w->d0; d < w->d1; d++) {
+        w->used[d] = 0;
     }
 
-    for (i = 0; i < s->lookup_size; i++) {
-        s->lookup[i].dest = NULL;
+    for (r = 0; r < w->rounds; r++) {
+        for (d = w->d0; d < w->d1; d++) {
+            cand = w->cand + w->rounds * (p->first[d] - base);
+            need = w->rounds * p->turns[d];
+
+            for (t = 0; t < p->turns[d]; t++) {
+                while (w->used[d] < need && mh_populate_taken(p, cand[w->used[d]])) {
+                    p->perm[d] = mh_perm_next(cand[w->used[d]++], p->skip[d], p->size);
+                }
+
+                if (w->used[d] < need) {
+                    c = cand[w->used[d]++];
+                } else {
+                    c = p->perm[d];
+                    while (mh_populate_taken(p, c))
+                        c = mh_perm_next(c, p->skip[d], p->size);
+                }
+
+                mh_populate_claim(p, c, d);
+                p->perm[d] = mh_perm_next(c, p->skip[d], p->size);
+            }
+        }
     }
 }
 
-static void mh_free_state(struct maglev_state *s)
+static int mh_populate_parallel(struct maglev_state *s, struct maglev_hash_service *svc,
+                                struct mh_pool *pool)
 {
-    if (!s)
-        return;
+    struct mh_populate_window w;
+    struct mh_populate p;
+    uint32_t budget;
+    int ret;
 
-    VLOG_INFO("Free Maglev State: state=%p, lookup_size=%u", s, s->lookup_size);
+    if (s->gcd < 1)
+        return 0;
+
+    ret = mh_populate_init(&p, s, svc);
+    if (ret < 0)
+        return ret;
 
-    /* refcnt starts 1 */
-    if (ovs_refcount_read(&s->refcnt) > 1) {
-        VLOG_WARN("WARNING: Maglev State under referenced: refcnt=%d", ovs_refcount_read(&s->refcnt));
+    memset(&w, 0, sizeof w);
+    w.p = &p;
+    w.cand = xcalloc(p.size / 8 + 1, sizeof(uint32_t));
+    w.used = xcalloc(p.n_active, sizeof(uint32_t));
+    if (!w.cand || !w.used) {
+        ret = -ENOMEM;
+        goto out;
     }
 
-    mh_reset_state(s);
+    /* each window starts at the turn of dest p.i, with p.t == 0 */
+    while (p.size - p.n >= MH_POPULATE_PARALLEL_MIN_FREE) {
+        budget = (p.size - p.n) / 8;
+
+        w.d0 = p.i;
+        if (w.d0 == 0 && p.first[p.n_active] <= budget) {
+            /* whole rounds */
+            w.d1 = p.n_active;
+            w.rounds = budget / p.first[p.n_active];
+        } else {
+            /* the dests of this round that fit */
+            w.d1 = mh_populate_find(&p, w.d0, p.n_active, p.first[w.d0] + budget + 1) - 1;
+            w.rounds = 1;
+            if (w.d1 <= w.d0)
+                break;  /* a single dest takes more than the budget */
+        }
+
+        mh_pool_run(pool, mh_populate_speculate, &w);
+        mh_populate_commit(&w);
 
-    if (s->lookup) {
-        free(s->lookup);
-        s->lookup = NULL;
+        p.i = w.d1 == p.n_active ? 0 : w.d1;
     }
 
-    free(s);
+    mh_populate_probe(&p, p.size - mh_populate_dense_tail(p.size));
+    ret = mh_populate_dense(&p);
+
+out:
+    free(w.used);
+    free(w.cand);
+    mh_populate_fini(&p);
+    return ret;
 }
 
-static void mh_ref_state(struct maglev_state *s)
+static enum mh_populate_engine mh_populate_engine = MH_POPULATE_FAST;
+
+/* Selects the engine used by the following table builds. The engines fill
+ * identical tables; MH_POPULATE_LIST is kept as the reference. */
+void mh_set_populate_engine(enum mh_populate_engine engine)
 {
-    ovs_refcount_ref(&s->refcnt);
+    mh_populate_engine = engine;
 }
 
-static void mh_unref_state(struct maglev_state *s)
+/* 'pool' is the pool to build with, if any */
+static int mh_populate(struct maglev_state *s, struct maglev_hash_service *svc, struct mh_pool *pool)
 {
-    /* ovs_refcount_unref returns the previous value */
-    /* 2 means the last reference because refcnt starts 1 */ 
-    if (ovs_refcount_unref(&s->refcnt) == 2) {
-        // now refcnt is 1
-        mh_free_state(s);
+    switch (mh_populate_engine) {
+    case MH_POPULATE_LIST:
+        return mh_populate_list(s, svc);
+    case MH_POPULATE_FAST:
+    default:
+        if (mh_pool_size(pool) > 1 && svc->table_size >= MH_POPULATE_PARALLEL_MIN)
+            return mh_populate_parallel(s, svc, pool);
+
+        return mh_populate_fast(s, svc);
     }
 }
 
-static void mh_attach_state(struct maglev_state *s, struct maglev_hash_service *svc)
+/* Get maglev_dest associated with supplied parameters.
+ *
+ * Generic lookup of the table sizes without a specialized function below.
+ * The modulo goes through the divider of the state, as in the batch
+ * kernels: there is no separate '%' path to compare them with. */
+static struct maglev_dest* mh_lookup_dest(struct maglev_state *s,  uint32_t hash_data)
 {
-    struct maglev_state *old = svc->mh_state;
-    if (old) {
-        mh_unref_state(old);
-    }
-
-    if (s) {
-        mh_ref_state(s);
+    if (!s) {
+        return NULL;
     }
 
-    svc->mh_state = s;
+    return mh_get_lookup_dest(s, hash_data);
 }
 
-static struct maglev_state* mh_hold_state(struct maglev_hash_service *svc)
+/* Allocates the zeroed lookup table and the dests[] array of the new state
+ * 's' for 'num_dests' destinations and fills dests[] in the list order. */
+static int mh_alloc_lookup(struct maglev_state *s, struct maglev_hash_service *svc, int num_dests)
 {
-    if (svc == NULL || svc->mh_state == NULL) {
-        return NULL;
+    struct maglev_dest **dests;
+    struct maglev_dest *dest;
+    bool wide = num_dests > MH_LOOKUP16_MAX_DESTS;
+    int i;
+
+    /* one spare entry so that SIMD kernels can read 16-bit entries
+     * 32 bits at a time */
+    s->lookup = xcalloc(s->lookup_size + 1, wide ? sizeof(uint32_t) : sizeof(uint16_t));
+    if (!s->lookup)
+        return -ENOMEM;
+
+    s->lookup_wide = wide;
+
+    dests = xcalloc(num_dests + 1, sizeof *dests);
+    if (!dests)
+        return -ENOMEM;
+
+    i = 0;
+    dests[i++] = NULL;
+    LIST_FOR_EACH (dest, n_list, &svc->destinations) {
+        dests[i++] = dest;
     }
 
-    mh_ref_state(svc->mh_state);
-    return svc->mh_state;
+    s->dests = dests;
+    s->n_dests = num_dests;
+
+    return 0;
 }
 
-static void mh_release_state(struct maglev_state *s)
-{
-    if (s) {
-        mh_unref_state(s);
-    }
+/* Lookup functions specialized per table size
+ *
+ * The table size of a state is fixed and usually one of MH_PRIMES, so each
+ * of these sizes gets its own lookup function in which the modulo is a
+ * compile-time constant (turned into a multiply and shifts by the
+ * compiler). mh_build_hash_table() stores the matching function in the
+ * state. Results are identical to mh_lookup_dest(), which other sizes use
+ * with the divider of the state.
+ */
+#define MH_LOOKUP_FNS(SIZE) \
+static struct maglev_dest* mh_lookup_dest_##SIZE(struct maglev_state *s, uint32_t hash_data) \
+{ \
+    return s->dests[mh_lookup_index(s, hash_data % SIZE)]; \
 }
 
-static void mh_free_dest(struct maglev_hash_service *svc) 
+MH_PRIMES(MH_LOOKUP_FNS)
+
+#define MH_LOOKUP_FN_ENTRY(SIZE) { SIZE, mh_lookup_dest_##SIZE },
+
+static const struct {
+    uint32_t        size;
+    mh_lookup_fn    *lookup;
+} mh_lookup_fns[] = {
+    MH_PRIMES(MH_LOOKUP_FN_ENTRY)
+};
+
+/* Returns the lookup function for a table of 'size' slots. Sizes without a
+ * specialized function use the generic one. */
+static mh_lookup_fn* mh_select_lookup_fn(uint32_t size)
 {
-    struct maglev_dest *dest, *next;
-    LIST_FOR_EACH_SAFE(dest, next, n_list, &svc->destinations) {
-        ovs_list_remove(&dest->n_list);
+    size_t i;
 
-        VLOG_INFO("free dest: %u:%u:%u:%p", dest->gid, dest->dest_id, dest->weight, dest);
-        free(dest);
+    for (i = 0; i < ARRAY_SIZE(mh_lookup_fns); i++) {
+        if (mh_lookup_fns[i].size == size)
+            return mh_lookup_fns[i].lookup;
     }
+
+    return mh_lookup_dest;
 }
 
-static struct maglev_dest* mh_get_dest(uint32_t id, struct maglev_hash_service *svc) 
+/* Replaces the entries of unavailable dests in the lookup table of 's', so
+ * that lookups read a single entry whatever the dest availability.
+ *
+ * In fallback mode, a slot of an unavailable dest gets the dest it would
+ * have if only the available dests were in the table: a second table is
+ * populated without the unavailable dests, with the weights scaled by their
+ * own gcd and shift, so their slots go where a removal would put them while
+ * the flows of available dests stay put. Otherwise the slot is emptied and
+ * selects no dest. */
+static int mh_build_active_table(struct maglev_state *s, struct maglev_hash_service *svc,
+                                 struct mh_pool *pool)
 {
+    bool fallback = svc->flags & MH_FLAG_FALLBACK;
+    uint32_t i, k, n_available = 0, n_unavailable = 0;
     struct maglev_dest *dest;
+    void *primary, *alt;
+    int gcd, rshift;
+    int ret;
 
-    LIST_FOR_EACH (dest, n_list, &svc->destinations) {
-        if (dest->dest_id == id) {
-            return dest;
-        }
+    for (k = 1; k <= s->n_dests; k++) {
+        dest = s->dests[k];
+        if (is_unavailable(dest))
+            n_unavailable++;
+        else if (dest->last_weight)
+            n_available++;
+    }
+
+    if (!n_unavailable)
+        return 0;
+
+    alt = NULL;
+    if (fallback && n_available) {
+        primary = s->lookup;
+        s->lookup = xcalloc(s->lookup_size + 1, mh_lookup_entry_size(s));
+        if (!s->lookup) {
+            s->lookup = primary;
+            return -ENOMEM;
+        }
+
+        gcd = s->gcd;
+        rshift = s->rshift;
+        s->gcd = mh_gcd_weight(svc, true);
+        s->rshift = mh_shift_weight(svc, s->gcd, true);
+
+        mh_permutate(s, svc, pool, true);
+        ret = mh_populate(s, svc, pool);
+
+        s->gcd = gcd;
+        s->rshift = rshift;
+        alt = s->lookup;
+        s->lookup = primary;
+        if (ret < 0) {
+            free(alt);
+            return ret;
+        }
+
+        /* for the fallback counter */
+        s->fallback_map = xcalloc(BITS_TO_LONGS(s->lookup_size), sizeof(unsigned long));
+        if (!s->fallback_map) {
+            free(alt);
+            return -ENOMEM;
+        }
+    }
+
+    for (i = 0; i < s->lookup_size; i++) {
+        k = mh_lookup_index(s, i);
+        if (k && is_unavailable(s->dests[k])) {
+            k = !alt ? 0 : s->lookup_wide ? ((uint32_t *)alt)[i] : ((uint16_t *)alt)[i];
+            mh_set_lookup_index(s, i, k);
+            if (alt)
+                set_bit(i, s->fallback_map);
+        }
+    }
+
+    VLOG_INFO("Maglev active table: %u unavailable dests, %s", n_unavailable,
+              alt ? "fallback to the available dests" : "no fallback");
+
+    free(alt);
+    return 0;
+}
+
+/* Assign all the hash buckets of the specified table with the service. */
+static int mh_build_lookup_table(struct maglev_state *s, struct maglev_hash_service *svc,
+                                 struct mh_pool *pool)
+{
+    int ret=0;
+    int num_dests = mh_get_dest_count(svc);
+    uint64_t t;
+
+    if (num_dests > svc->table_size)
+        return -EINVAL;
+
+    t = mh_time_ns();
+    ret = mh_alloc_lookup(s, svc, num_dests);
+    if (ret < 0)
+        return ret;
+
+    if (num_dests >= 1) {
+        s->dest_setup = xcalloc(num_dests, sizeof(struct maglev_dest_setup));
+        if (!s->dest_setup)
+            return -ENOMEM;
+    }
+    mh_build_times.alloc = mh_time_ns() - t;
+
+    t = mh_time_ns();
+    mh_permutate(s, svc, pool, false);
+    mh_build_times.permutate = mh_time_ns() - t;
+
+    t = mh_time_ns();
+    ret = mh_populate(s, svc, pool);
+    if (ret == 0)
+        ret = mh_build_active_table(s, svc, pool);
+    mh_build_times.populate = mh_time_ns() - t;
+
+    if (s->dest_setup) {
+        free(s->dest_setup);
+        s->dest_setup = NULL;
+    }
+
+    return ret;
+}
+
+/* With 'available_only', the unavailable dests are left out, as in
+ * mh_permutate(). */
+static int mh_gcd_weight(struct maglev_hash_service *svc, bool available_only)
+{
+    struct maglev_dest *dest;
+    int weight;
+    int g = 0;
+
+    LIST_FOR_EACH(dest, n_list, &svc->destinations) {
+        if (available_only && is_unavailable(dest))
+            continue;
+        weight = dest->last_weight;
+        if (weight > 0) {
+            if (g > 0)
+                g = gcd(weight, g);
+            else
+                g = weight;
+        }
+    }
+
+    return g;
+}
+
+/* To avoid assigning huge weight for the MH table,
+ * calculate shift value with gcd.
+ */
+static int mh_shift_weight(struct maglev_hash_service *svc, int gcd, bool available_only)
+{
+    struct maglev_dest *dest;
+    int new_weight, weight = 0;
+    int mw, shift;
+
+    /* If gcd is smaller then 1, number of dests or
+     * all last_weight of dests are zero. So, return
+     * shift value as zero.
+     */
+    if (gcd < 1)
+        return 0;
+
+    LIST_FOR_EACH(dest, n_list, &svc->destinations) {
+        if (available_only && is_unavailable(dest))
+            continue;
+        new_weight = dest->last_weight;
+        if (new_weight > weight)
+            weight = new_weight;
+    }
+
+    /* Because gcd is greater than zero,
+     * the maximum weight and gcd are always greater than zero
+     */
+    mw = weight / gcd;
+
+    int tab_bits = bitlen(svc->table_size)/2;
+
+    /* shift = occupied bits of weight/gcd - MH highest bits */
+    shift = fls(mw) - tab_bits;
+    return (shift >= 0) ? shift : 0;
+}
+
+static struct maglev_state* mh_alloc_state(uint32_t table_size)
+{
+    struct maglev_state *s;
+
+    /* Allocate the MH table for this service */
+    s = xcalloc(1, sizeof(struct maglev_state));
+    if (!s)
+        return NULL;
+
+    /* the lookup table is sized by mh_alloc_lookup() once the number of
+     * dests is known */
+    s->lookup_size = table_size;
+    mh_divider_init(&s->div, table_size);
+    s->lookup_kernel = mh_select_lookup_kernel();
+
+    VLOG_INFO("Alloc Maglev State: state=%p, lookup_size=%u", s, table_size);
+
+    return s;
+}
+
+static void mh_init_state(struct maglev_state *s, struct maglev_hash_service *svc)
+{
+    s->gcd = mh_gcd_weight(svc, false);
+    s->rshift = mh_shift_weight(svc, s->gcd, false);
+}
+
+static void mh_free_state(struct maglev_state *s)
+{
+    if (!s)
+        return;
+
+    VLOG_INFO("Free Maglev State: state=%p, lookup_size=%u", s, s->lookup_size);
+
+    free(s->lookup);
+    free(s->dests);
+    free(s->fallback_map);
+    free(s);
+}
+
+/* Publishes 's' as the state of 'svc'. Readers may still be using the old
+ * state, so it is freed only after an RCU grace period. */
+static void mh_attach_state(struct maglev_state *s, struct maglev_hash_service *svc)
+{
+    struct maglev_state *old = ovsrcu_get_protected(struct maglev_state *, &svc->mh_state);
+
+    ovsrcu_set(&svc->mh_state, s);
+
+    if (old) {
+        ovsrcu_postpone(mh_free_state, old);
+    }
+}
+
+/* Returns the current state of 'svc' for the data path.
+ *
+ * No reference is taken: the state stays valid until the calling thread
+ * passes its next RCU quiescent point, so lookups do not write any shared
+ * memory. */
+static struct maglev_state* mh_get_state(struct maglev_hash_service *svc)
+{
+    if (svc == NULL) {
+        return NULL;
+    }
+
+    return ovsrcu_get(struct maglev_state *, &svc->mh_state);
+}
+
+static void mh_free_dest(struct maglev_hash_service *svc) 
+{
+    struct maglev_dest *dest, *next;
+    LIST_FOR_EACH_SAFE(dest, next, n_list, &svc->destinations) {
+        ovs_list_remove(&dest->n_list);
+
+        VLOG_INFO("free dest: %u:%u:%u:%p", dest->gid, dest->dest_id, dest->weight, dest);
+        free(dest);
+    }
+}
+
+static struct maglev_dest* mh_get_dest(uint32_t id, struct maglev_hash_service *svc) 
+{
+    struct maglev_dest *dest;
+
+    LIST_FOR_EACH (dest, n_list, &svc->destinations) {
+        if (dest->dest_id == id) {
+            return dest;
+        }
     }
 
     return NULL;
 }
 
+/* Dests of a service being filled, by id, so that adding N dests does not
+ * walk the list N times. Open addressing, kept at most half full. */
+struct mh_dest_index {
+    struct maglev_dest  **slots;
+    uint32_t            mask;
+};
+
+static void mh_dest_index_init(struct mh_dest_index *index, size_t n_dests)
+{
+    uint32_t size = 16;
+
+    while (size < 2 * n_dests)
+        size <<= 1;
+
+    index->slots = xcalloc(size, sizeof *index->slots);
+    index->mask = index->slots ? size - 1 : 0;
+}
+
+static void mh_dest_index_destroy(struct mh_dest_index *index)
+{
+    free(index->slots);
+}
+
+/* Returns the slot of dest 'id', holding NULL if it is not there yet. */
+static struct maglev_dest** mh_dest_index_find(struct mh_dest_index *index, uint32_t id)
+{
+    uint32_t i = (id * 2654435761u) & index->mask;
+
+    while (index->slots[i] && index->slots[i]->dest_id != id)
+        i = (i + 1) & index->mask;
+
+    return &index->slots[i];
+}
+
 static void mh_set_dest_weight(struct maglev_dest* dest, uint32_t weight)
 {
     dest->weight = weight;
@@ -507,30 +1184,43 @@ static struct maglev_hash_service* mh_alloc_service(uint32_t table_size)
     ovs_list_init(&svc->destinations);
     svc->table_size = table_size;
 
-    /* refcnt starts 1 */
-    //ovs_refcount_init(&svc->refcnt);
     //atomic_count_init(&svc->version, 1);
-    
-    svc->refcnt = 1;
 
     VLOG_INFO("Alloc Maglev Hash SVC: svc=%p, table_size=%u", svc, table_size);
     return svc;
 }
 
-static void mh_free_service(struct maglev_hash_service* svc)
+static void mh_free_service__(struct maglev_hash_service* svc)
 {
+    size_t i;
+
     VLOG_INFO("Free Maglev Hash SVC: svc=%p, table_size=%u", svc, svc->table_size);
 
-    mh_attach_state(NULL, svc);
+    mh_free_state(ovsrcu_get_protected(struct maglev_state *, &svc->mh_state));
     mh_free_dest(svc);
 
+    for (i = 0; i < ARRAY_SIZE(svc->stats); i++) {
+        free(svc->stats[i]);
+    }
+
     free(svc);
 }
 
-static int mh_add_dest(uint32_t gid, uint32_t id, uint16_t weight, void *data, struct maglev_hash_service *svc)
+/* Readers may still be looking up through 'svc' and the dests its state
+ * points to, so the whole service is freed after an RCU grace period. */
+static void mh_free_service(struct maglev_hash_service* svc)
+{
+    ovsrcu_postpone(mh_free_service__, svc);
+}
+
+/* Adds dest 'id' to 'svc', or updates it if already there. 'index', if it
+ * has slots, holds the dests of 'svc' and gets the new one. */
+static int mh_add_dest(uint32_t gid, uint32_t id, uint16_t weight, void *data, struct maglev_hash_service *svc,
+                       struct mh_dest_index *index)
 {
     int ret = 0;
-    struct maglev_dest* dest = mh_get_dest(id, svc);
+    struct maglev_dest **slot = index->slots ? mh_dest_index_find(index, id) : NULL;
+    struct maglev_dest* dest = slot ? *slot : mh_get_dest(id, svc);
 
     if (dest != NULL) {
         //atomic_count_set(&dest->version, atomic_count_get(&svc->version));
@@ -565,20 +1255,32 @@ static int mh_add_dest(uint32_t gid, uint32_t id, uint16_t weight, void *data, s
     dest->last_weight = weight;
     dest->gid = gid;
     dest->dest_id = id;
+    dest->idx = ++svc->n_dests;
     dest->data = data;
 
     VLOG_INFO("add dest: %u:%u:%u:%p", dest->gid, dest->dest_id, dest->weight, dest);
 
     ovs_list_push_back(&svc->destinations, &dest->n_list);
+    if (slot)
+        *slot = dest;
 
     return 1;
 }
 
-static int mh_build_hash_table(struct maglev_hash_service *svc)
+/* Builds a new state for the current dests of 'svc' and publishes it.
+ *
+ * The current state is never written: the new table is built aside and
+ * swapped in with a single pointer store once complete, so lookups running
+ * meanwhile keep using the old table, which is freed after they are done
+ * with it. */
+static int mh_build_hash_table(struct maglev_hash_service *svc, struct mh_pool *pool)
 {
     int ret;
-    struct maglev_state *s, *old;
+    struct maglev_state *s;
     int num_dests = mh_get_dest_count(svc);
+    uint64_t start = mh_time_ns(), t;
+
+    memset(&mh_build_times, 0, sizeof mh_build_times);
 
     VLOG_INFO("Building Maglev Hash Lookup Table: svc=%p, flags=0x%x, table_size=%u, dest cnt=%d", 
               svc,
@@ -586,205 +1288,753 @@ static int mh_build_hash_table(struct maglev_hash_service *svc)
               svc->table_size, 
               num_dests);
 
-    old = mh_hold_state(svc);
-    if (old) {
-        s = old;
-    } else {
-        /* Allocate the MH table for this service */
-        s =  mh_alloc_state(svc->table_size);
-        if (!s)
-            return -ENOMEM;
-
-        VLOG_INFO("Maglev Lookup Table (memory=%lu bytes) allocated for current service",
-                  sizeof(struct maglev_lookup) * svc->table_size);
-    }
+    /* Allocate the MH table for this service */
+    s = mh_alloc_state(svc->table_size);
+    if (!s)
+        return -ENOMEM;
 
+    t = mh_time_ns();
     mh_init_state(s, svc);
+    mh_build_times.gcd = mh_time_ns() - t;
 
     /* Assign the lookup table with current dests */
-    ret = mh_build_lookup_table(s, svc);
+    ret = mh_build_lookup_table(s, svc, pool);
     if (ret < 0) {
         VLOG_INFO("failed to build lookup table: err=%d", ret);
-
-        if (old == NULL) {
-            mh_free_state(s);
-        }
-
+        mh_free_state(s);
         return ret;
     }
 
-    if (old == s) {
-        mh_release_state(s);
-    } else {
-        /* No more failures, attach state */
-        /* the old one would be released if exists */
-        mh_attach_state(s, svc);
-    }
+    s->lookup_fn = mh_select_lookup_fn(s->lookup_size);
+
+    VLOG_INFO("Maglev Lookup Table (memory=%lu bytes, %s entries) built for current service",
+              mh_lookup_entry_size(s) * s->lookup_size, s->lookup_wide ? "32-bit" : "16-bit");
+
+    /* No more failures, attach state */
+    mh_attach_state(s, svc);
+
+    mh_build_times.total = mh_time_ns() - start;
 
     return 0;
 }
 
-static int mh_dump_lookup_table(struct maglev_hash_service *svc) 
+/* Builds a new service for the buckets of 'group' and swaps it in. Lookups
+ * keep using the old service until then; it is freed once they are done.
+ * The table is built with the threads of 'pool', if not NULL.
+ * Returns 0 or a negative errno; on failure the old service stays in use. */
+static int mh_build(struct group_dpif *group, struct mh_pool *pool)
 {
-    struct dump_cnt {
-        struct maglev_dest *dest;
-        uint32_t cnt;
-    };
+    struct maglev_hash_service* mh_svc, *old_svc;
+    struct ofputil_bucket *bucket;
+    struct maglev_dest *dest, *new_dest;
+    struct mh_dest_index index;
+    uint32_t tab_size=0;
+    uint64_t start = mh_time_ns(), setup;
 
-    struct maglev_state *s = mh_hold_state(svc);
-    if (!s)
-        return 0;
+    old_svc = ovsrcu_get_protected(struct maglev_hash_service *, &group->mh_svc);
 
-    int num_dests = mh_get_dest_count(svc);
-    struct maglev_dest *dest;
-    int i,k;
-    struct dump_cnt *dcnt = xcalloc(num_dests, sizeof(struct dump_cnt));
+    if (group->mh_table_size)
+        tab_size = mh_round_table_size(group->mh_table_size);
+    else
+        tab_size = mh_get_table_size((uint32_t)group->hash_alg);
+    mh_svc = mh_alloc_service(tab_size);
+    if (mh_svc == NULL) {
+        VLOG_WARN("failed to alloc a new Maglev Hash SVC: group=%u(%p)", group->up.group_id, group);
+        return -ENOMEM;
+    }
 
-    i=0;
-    LIST_FOR_EACH (dest, n_list, &svc->destinations) {
-        dcnt[i].dest = dest;
-        dcnt[i].cnt = 0;
-        i ++;
+    mh_svc->flags = group->hash_basis;
+
+    VLOG_INFO("Start building a new Maglev Hash SVC: group=%u(%p), mh_svc=%p, flags=0x%x, table_size=%u(%u)", 
+              group->up.group_id, group, mh_svc, mh_svc->flags, tab_size, group->hash_alg);
+
+    mh_dest_index_init(&index, ovs_list_size(&group->up.buckets));
+    LIST_FOR_EACH (bucket, list_node, &group->up.buckets) {
+        mh_add_dest(group->up.group_id, bucket->bucket_id, bucket->weight, bucket, mh_svc, &index);
     }
 
-    struct maglev_lookup *lookup = svc->mh_state->lookup;
-    for (i=0; i<svc->table_size; i++) {
-        dest = lookup[i].dest;
-        if (dest == NULL) {
-            continue;
-        }
+    /* dests keep their availability across rebuilds */
+    if (old_svc) {
+        LIST_FOR_EACH (dest, n_list, &old_svc->destinations) {
+            if (!is_unavailable(dest))
+                continue;
 
-        for (k=0; k<num_dests; k++) { 
-            if (dest == dcnt[k].dest) {
-                dcnt[k].cnt ++;
-            }
+            new_dest = index.slots ? *mh_dest_index_find(&index, dest->dest_id)
+                                   : mh_get_dest(dest->dest_id, mh_svc);
+            if (new_dest)
+                new_dest->flags |= MH_DEST_FLAG_DISABLE;
         }
-
-        //VLOG_DBG("Maglev Look(%d): dest=%u:%u:%u:%p", i, dest->gid, dest->dest_id, dest->weight, dest);
     }
+    mh_dest_index_destroy(&index);
+    setup = mh_time_ns() - start;
 
-    for (i=0; i<num_dests; i++) {
-        VLOG_INFO("Maglev Dest(%d): id=%u:%u:%u:%p, occupying lookup entry cnt=%u", 
-                  i, 
-                  dcnt[i].dest->gid, dcnt[i].dest->dest_id, dcnt[i].dest->weight, dcnt[i].dest, dcnt[i].cnt);
+    int ret;
+    ret = mh_build_hash_table(mh_svc, pool);
+    mh_build_times.setup = setup;
+    if (ret != 0) {
+        VLOG_WARN("failed to build Maglev Hash Lookup Table: group=%u(%p), mh_svc=%p, ret=%d, keeping mh_svc=%p",
+                  group->up.group_id, group, mh_svc, ret, old_svc);
+        mh_free_service(mh_svc);
+        return ret;
     }
 
-    if (s)
-        mh_release_state(s);
+    ovsrcu_set(&group->mh_svc, mh_svc);
+
+    if (old_svc) {
+        mh_free_service(old_svc);
+    }
 
-    free(dcnt);
+    mh_build_times.total = mh_time_ns() - start;
 
     return 0;
 }
 
-static void mh_build(struct group_dpif *group)
+
+/* Lookup counters
+ *
+ * Each service has a slot of counters per thread, allocated by the thread
+ * on its first lookup through the service and only written by it, so the
+ * counters are plain increments without atomics. The slots are cache line
+ * aligned and padded, they do not share lines. Threads take the lowest free
+ * slot number on their first lookup and give it back when they exit; a
+ * thread reusing a number adds to the counters of the exited one. The
+ * threads past MH_STATS_MAX_THREADS share the last slot with atomic
+ * increments. mh_get_stats() sums the slots on demand.
+ *
+ * The number of lookups is not counted but summed from the hits and the
+ * nulls: a counter bumped by every lookup chains them through memory.
+ */
+struct mh_thread_stats {
+    uint64_t    nulls;
+    uint64_t    fallbacks;
+    bool        shared;
+    uint64_t    hits[];         /* by dest index, [0] unused */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define MH_STATS_ADD(TS, FIELD, N) do { \
+        if (OVS_LIKELY(!(TS)->shared)) \
+            (TS)->FIELD += (N); \
+        else \
+            __atomic_fetch_add(&(TS)->FIELD, (N), __ATOMIC_RELAXED); \
+    } while (0)
+
+_Static_assert(MH_STATS_MAX_THREADS <= 64, "slot numbers do not fit mh_stats_tids");
+
+static bool mh_stats_enabled = false;
+static uint64_t mh_stats_tids;                  /* slot numbers in use */
+static pthread_once_t mh_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mh_stats_key;
+static __thread unsigned int mh_stats_tid;      /* slot + 1, 0: unnumbered */
+
+/* Gives the slot number of an exiting thread back. */
+static void mh_stats_put_tid(void *tid)
 {
-    struct maglev_hash_service* mh_svc;
-    struct ofputil_bucket *bucket;
-    uint32_t tab_size=0;
+    unsigned int slot = (uintptr_t)tid - 1;
 
-    if (group->mh_svc) {
-        mh_free_service(group->mh_svc);
-    }
+    __atomic_fetch_and(&mh_stats_tids, ~(UINT64_C(1) << slot), __ATOMIC_RELEASE);
+}
 
-    group->mh_svc = NULL;
+static void mh_stats_init_key(void)
+{
+    pthread_key_create(&mh_stats_key, mh_stats_put_tid);
+}
 
-    tab_size = mh_get_table_size((uint32_t)group->hash_alg);
-    mh_svc = mh_alloc_service(tab_size);
-    if (mh_svc == NULL) {
-        VLOG_INFO("failed to alloc a new Maglev Hash SVC: group=%u(%p)", group->up.group_id, group);
-        return;
+/* Numbers the calling thread with the lowest free slot, or the shared one
+ * if none is free. */
+static void mh_stats_get_tid(void)
+{
+    uint64_t tids = __atomic_load_n(&mh_stats_tids, __ATOMIC_RELAXED);
+    uint64_t all = MH_STATS_MAX_THREADS < 64 ? (UINT64_C(1) << MH_STATS_MAX_THREADS) - 1 : UINT64_MAX;
+    unsigned int slot;
+
+    pthread_once(&mh_stats_once, mh_stats_init_key);
+
+    while (tids != all) {
+        slot = __builtin_ctzll(~tids);
+        if (__atomic_compare_exchange_n(&mh_stats_tids, &tids, tids | (UINT64_C(1) << slot), false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            mh_stats_tid = slot + 1;
+            pthread_setspecific(mh_stats_key, (void *)(uintptr_t)mh_stats_tid);
+            return;
+        }
     }
 
-    mh_svc->flags = group->hash_basis;
+    mh_stats_tid = MH_STATS_MAX_THREADS + 1;
+}
 
-    VLOG_INFO("Start building a new Maglev Hash SVC: group=%u(%p), mh_svc=%p, flags=0x%x, table_size=%u(%u)", 
-              group->up.group_id, group, mh_svc, mh_svc->flags, tab_size, group->hash_alg);
+static struct mh_thread_stats* mh_alloc_thread_stats(struct maglev_hash_service *svc, unsigned int slot)
+{
+    struct mh_thread_stats *ts, *expected = NULL;
+    size_t size = ROUND_UP(sizeof *ts + (svc->n_dests + 1) * sizeof ts->hits[0], CACHE_LINE_SIZE);
 
-    LIST_FOR_EACH (bucket, list_node, &group->up.buckets) {
-        mh_add_dest(group->up.group_id, bucket->bucket_id, bucket->weight, bucket, mh_svc);
-    }
+    if (posix_memalign((void **)&ts, CACHE_LINE_SIZE, size))
+        return NULL;
 
-    int ret;
-    ret = mh_build_hash_table(mh_svc);
-    if (ret != 0) {
-        VLOG_INFO("failed to build Maglev Hash Lookup Table: group=%u(%p), mh_svc=%p, ret=%d", 
-                 group->up.group_id, group, mh_svc, ret);
-        mh_free_service(mh_svc);
-    }
+    memset(ts, 0, size);
+    ts->shared = slot == MH_STATS_MAX_THREADS;
 
-    if (mh_svc) {
-        mh_dump_lookup_table(mh_svc);
+    /* only the shared slot can be raced for */
+    if (!__atomic_compare_exchange_n(&svc->stats[slot], &expected, ts, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        free(ts);
+        ts = expected;
     }
 
-    // XXX: use refcnt
-    group->mh_svc = mh_svc;
+    return ts;
 }
 
+/* Returns the counters of the calling thread for 'svc', NULL if they could
+ * not be allocated. */
+static inline struct mh_thread_stats* mh_get_thread_stats(struct maglev_hash_service *svc)
+{
+    struct mh_thread_stats *ts;
+
+    if (OVS_UNLIKELY(!mh_stats_tid))
+        mh_stats_get_tid();
+
+    ts = __atomic_load_n(&svc->stats[mh_stats_tid - 1], __ATOMIC_ACQUIRE);
+    if (OVS_UNLIKELY(!ts))
+        ts = mh_alloc_thread_stats(svc, mh_stats_tid - 1);
+
+    return ts;
+}
+
+static inline void mh_count_lookup(struct mh_thread_stats *ts, const struct maglev_state *s, uint32_t hash_data,
+                                   const struct maglev_dest *dest)
+{
+    if (OVS_UNLIKELY(!dest)) {
+        MH_STATS_ADD(ts, nulls, 1);
+        return;
+    }
+
+    MH_STATS_ADD(ts, hits[dest->idx], 1);
+
+    if (OVS_UNLIKELY(s->fallback_map != NULL)
+        && test_bit(mh_divider_mod(&s->div, hash_data), s->fallback_map)) {
+        MH_STATS_ADD(ts, fallbacks, 1);
+    }
+}
 
 /* Maglev Hashing lookup */
 static struct maglev_dest* mh_lookup_(struct maglev_hash_service *svc, uint32_t hash_data)
 {
     struct maglev_dest *dest = NULL;
+    struct mh_thread_stats *ts;
     struct maglev_state *s;
 
     if (svc == NULL)
         return NULL;
 
-    s = mh_hold_state(svc);
+    s = mh_get_state(svc);
     if (!s)
         return NULL;
 
-    if (svc->flags & MH_FLAG_FALLBACK)
-        dest = mh_lookup_dest_fallback(s, hash_data);
-    else
-        dest = mh_lookup_dest(s, hash_data);
-
-    mh_release_state(s);
+    dest = s->lookup_fn(s, hash_data);
 
-#if 0
-    if (!dest) {
-        VLOG_INFO("Lookup Dest is unavailable: hash_data=%u", hash_data);
-    } 
-#endif
+    if (mh_stats_enabled) {
+        ts = mh_get_thread_stats(svc);
+        if (OVS_LIKELY(ts != NULL))
+            mh_count_lookup(ts, s, hash_data, dest);
+    }
 
     return dest;
 }
 
+/* Maglev Hashing batch lookup
+ *
+ * Resolves 'n' hashes against one snapshot of the state. The hashes are
+ * processed in chunks of MH_LOOKUP_BATCH: the lookup kernel of the state
+ * resolves the lookup entries of a whole chunk (scalar with prefetch, or
+ * SIMD gathers), the destinations they point to are prefetched, and the
+ * destinations are only read after that, so the cache misses of a
+ * chunk are in flight at the same time.
+ */
+static void mh_lookup_batch_(struct maglev_hash_service *svc, const uint32_t *hashes, size_t n,
+                             struct ofputil_bucket **buckets)
+{
+    struct maglev_dest *dests[MH_LOOKUP_BATCH];
+    struct maglev_dest *dest;
+    struct mh_thread_stats *ts;
+    struct maglev_state *s;
+    size_t i, j, cnt;
+
+    s = mh_get_state(svc);
+    if (!s) {
+        memset(buckets, 0, n * sizeof *buckets);
+        return;
+    }
+
+    ts = mh_stats_enabled ? mh_get_thread_stats(svc) : NULL;
+
+    for (i = 0; i < n; i += cnt) {
+        cnt = MIN(n - i, MH_LOOKUP_BATCH);
+
+        s->lookup_kernel(s, hashes + i, cnt, dests);
+
+        for (j = 0; j < cnt; j++) {
+            if (dests[j]) {
+                OVS_PREFETCH(dests[j]);
+            }
+        }
+
+        for (j = 0; j < cnt; j++) {
+            dest = dests[j];
+            buckets[i + j] = dest ? (struct ofputil_bucket *)dest->data : NULL;
+
+            if (OVS_LIKELY(ts != NULL))
+                mh_count_lookup(ts, s, hashes[i + j], dest);
+        }
+    }
+}
+
 /////////////////////////////
 
-void mh_construct(struct group_dpif *new_group)
+/* Threads building the tables, NULL when builds are single-threaded. */
+static struct mh_pool *mh_build_pool;
+
+/* Sets the number of threads used by the following builds, 1 for none.
+ * Must not be called while a build is running. */
+void mh_set_build_threads(unsigned int n_threads)
+{
+    mh_pool_destroy(mh_build_pool);
+    mh_build_pool = NULL;
+
+    if (n_threads > 1) {
+        mh_build_pool = mh_pool_create(n_threads);
+    }
+
+    VLOG_INFO("Maglev build threads: %u", mh_pool_size(mh_build_pool));
+}
+
+/* Returns a table size giving each of 'n_dests' destinations at least
+ * MH_TABLE_SLOTS_PER_DEST slots, for group->mh_table_size. The sizes of
+ * the size index are used when large enough, they have specialized lookups. */
+uint32_t mh_table_size_for_dests(uint32_t n_dests)
+{
+#define MH_PRIME_VALUE(SIZE) SIZE,
+    static const uint32_t primes[] = { MH_PRIMES(MH_PRIME_VALUE) };
+#undef MH_PRIME_VALUE
+
+    uint64_t want = (uint64_t)MAX(n_dests, 1) * MH_TABLE_SLOTS_PER_DEST;
+    size_t i;
+
+    for (i = 1; i < ARRAY_SIZE(primes); i++) {
+        if (primes[i] >= want)
+            return primes[i];
+    }
+
+    return mh_round_table_size(MIN(want, MH_TABLE_SIZE_MAX));
+}
+
+/* Returns the time spent in the phases of the last build run by the calling
+ * thread: mh_construct(), mh_set_dest_available(), or one of the groups of
+ * mh_construct_groups() when called from a build thread. */
+void mh_get_build_times(struct mh_build_times *times)
+{
+    *times = mh_build_times;
+}
+
+/* Returns 0 or a negative errno, in which case the group keeps its previous
+ * service, if any. */
+int mh_construct(struct group_dpif *new_group)
 {
     VLOG_INFO("Construct Maglev Hash: new group=%u(%p), tab_size_idx=%u",
               new_group->up.group_id, new_group, (uint32_t)new_group->hash_alg);
 
-    mh_build(new_group);
+    return mh_build(new_group, mh_build_pool);
+}
+
+struct mh_construct_job {
+    struct group_dpif   **groups;
+    size_t              n_groups;
+    size_t              next;       /* next group to build */
+    int                 error;      /* of one of the failed builds */
+};
+
+static void mh_construct_worker(void *aux, unsigned int idx OVS_UNUSED, unsigned int n OVS_UNUSED)
+{
+    struct mh_construct_job *job = aux;
+    size_t i;
+    int ret;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_groups) {
+        ret = mh_build(job->groups[i], NULL);
+        if (ret)
+            __atomic_store_n(&job->error, ret, __ATOMIC_RELAXED);
+    }
+}
+
+/* Constructs 'n' groups, e.g. on a resync. The groups are built in parallel
+ * by the build threads, each one single-threaded. Returns 0, or the error of
+ * one of the groups that failed and kept their previous service. */
+int mh_construct_groups(struct group_dpif **groups, size_t n)
+{
+    struct mh_construct_job job = { groups, n, 0, 0 };
+
+    VLOG_INFO("Construct Maglev Hash: %zu groups, %u threads", n, mh_pool_size(mh_build_pool));
+
+    mh_pool_run(mh_build_pool, mh_construct_worker, &job);
+
+    return job.error;
+}
+
+/* Marks the dest of bucket 'bucket_id' of 'group' available or not and
+ * publishes a new state for it. Lookups that selected an unavailable dest
+ * get the fallback of mh_build_active_table() instead.
+ *
+ * Unlike mh_construct(), the flags of the dest are changed in place in the
+ * published service; lookups do not read them. So, as for mh_construct()
+ * and mh_destruct(), the caller runs the writers of a group one at a time,
+ * e.g. from a single thread.
+ * Returns 0, -ENOENT if the group has no such bucket, or a build error. */
+int mh_set_dest_available(struct group_dpif *group, uint32_t bucket_id, bool available)
+{
+    struct maglev_hash_service *svc;
+    struct maglev_dest *dest;
+    int ret;
+
+    svc = ovsrcu_get_protected(struct maglev_hash_service *, &group->mh_svc);
+    dest = svc ? mh_get_dest(bucket_id, svc) : NULL;
+    if (!dest)
+        return -ENOENT;
+
+    if (!is_unavailable(dest) == available)
+        return 0;
+
+    VLOG_INFO("Set Maglev dest %s: group=%u(%p), id=%u:%u",
+              available ? "available" : "unavailable", group->up.group_id, group, dest->gid, dest->dest_id);
+
+    dest->flags ^= MH_DEST_FLAG_DISABLE;
+
+    /* Lookups do not read the flags, they see the change with the new state */
+    ret = mh_build_hash_table(svc, mh_build_pool);
+    if (ret != 0) {
+        VLOG_WARN("failed to rebuild Maglev Hash Lookup Table: group=%u(%p), mh_svc=%p, ret=%d",
+                  group->up.group_id, group, svc, ret);
+        dest->flags ^= MH_DEST_FLAG_DISABLE;
+    }
+
+    return ret;
 }
 
 void mh_destruct(struct group_dpif *group)
 {
-    if (group == NULL || group->mh_svc == NULL)
+    if (group == NULL)
         return;
 
-    struct maglev_hash_service *svc = group->mh_svc;
+    struct maglev_hash_service *svc = ovsrcu_get_protected(struct maglev_hash_service *, &group->mh_svc);
+    if (svc == NULL)
+        return;
 
     VLOG_INFO("Destruct Maglev Hash: group=%u(%p), mh_svc=%p, method=%d", 
               group->up.group_id, group, svc, group->selection_method);
 
-    mh_free_service(group->mh_svc);
-    group->mh_svc = NULL;
+    ovsrcu_set(&group->mh_svc, NULL);
+    mh_free_service(svc);
 }
 
 struct ofputil_bucket* mh_lookup(struct group_dpif *group, uint32_t hash_data)
 {
-    if (group == NULL || group->mh_svc == NULL) {
+    if (group == NULL) {
         return NULL;
     }
 
-    struct maglev_dest *dest = mh_lookup_(group->mh_svc, hash_data);
+    struct maglev_dest *dest = mh_lookup_(ovsrcu_get(struct maglev_hash_service *, &group->mh_svc), hash_data);
     if (dest == NULL) {
         return NULL;
     }
 
     return (struct ofputil_bucket *)dest->data;
 }
+
+/* Looks up 'n' hashes at once, storing the selected bucket (or NULL) for
+ * hashes[i] in buckets[i]. Same results as calling mh_lookup() per hash. */
+void mh_lookup_batch(struct group_dpif *group, const uint32_t *hashes, size_t n,
+                     struct ofputil_bucket **buckets)
+{
+    if (group == NULL) {
+        memset(buckets, 0, n * sizeof *buckets);
+        return;
+    }
+
+    mh_lookup_batch_(ovsrcu_get(struct maglev_hash_service *, &group->mh_svc), hashes, n, buckets);
+}
+
+/////////////////////////////
+// flow pipeline
+
+/* Flows per stage of mh_lookup_flows() */
+#define MH_FLOW_BATCH 64
+
+/* hash_bytes() of each protocol byte, the basis of the flow key hash */
+static uint32_t mh_proto_basis[256];
+
+__attribute__((constructor))
+static void mh_proto_basis_init(void)
+{
+    uint8_t proto;
+    int i;
+
+    /* the bitwise engine needs no table, whatever runs first */
+    for (i = 0; i < 256; i++) {
+        proto = i;
+        mh_proto_basis[i] = hash_bytes1(&proto, sizeof proto, 0);
+    }
+}
+
+/* 'dst' may be unaligned: the address in a packed hash_val */
+static inline void mh_xor_in6(void *dst, const struct in6_addr *a, const struct in6_addr *b)
+{
+    uint64_t x[2], y[2];
+
+    memcpy(x, a, sizeof x);
+    memcpy(y, b, sizeof y);
+    x[0] ^= y[0];
+    x[1] ^= y[1];
+    memcpy(dst, x, sizeof x);
+}
+
+/* Flow key of IPv6 flow 'i', as the datapath builds it: the src and dst
+ * addresses and ports xor'ed, so both directions select the same bucket. */
+static inline void mh_flow_key6(const struct mh_flow_batch *flows, size_t i, struct hash_val *key)
+{
+    memset(key, 0, sizeof *key);
+    mh_xor_in6((uint8_t *)key + offsetof(struct hash_val, pkt), &flows->src_ip6[i],
+               &flows->dst_ip6[i]);
+    key->tp_port = flows->src_port[i] ^ flows->dst_port[i];
+}
+
+/* Selects the bucket of every flow of 'flows', storing its id (or
+ * MH_BUCKET_ID_NONE) in bucket_ids[i]. Same as hashing each flow key with
+ * hash_bytes36() from the hash of its protocol and calling mh_lookup().
+ *
+ * The flows go through the stages in chunks of MH_FLOW_BATCH: the whole
+ * chunk is hashed, then looked up with the batch lookup, so each stage
+ * runs over independent flows. IPv4 keys, zero but for 6 bytes, are
+ * hashed from their fields with hash_bytes36_ipv4_batch(); the keys of
+ * the IPv6 flows are built and hashed with hash_bytes36_batch(). */
+void mh_lookup_flows(struct group_dpif *group, const struct mh_flow_batch *flows,
+                     uint32_t *bucket_ids)
+{
+    /* IPv4 flows: [0, n4), IPv6 flows: [n6, MH_FLOW_BATCH) */
+    uint32_t addrs[MH_FLOW_BATCH];
+    uint16_t ports[MH_FLOW_BATCH];
+    struct hash_val keys[MH_FLOW_BATCH];
+    uint32_t bases[MH_FLOW_BATCH];
+    uint32_t hashes[MH_FLOW_BATCH];
+    uint8_t pos[MH_FLOW_BATCH];
+    uint32_t sorted[MH_FLOW_BATCH];
+    struct ofputil_bucket *buckets[MH_FLOW_BATCH];
+    struct maglev_hash_service *svc;
+    size_t i, j, k, cnt, n4, n6;
+
+    svc = group ? ovsrcu_get(struct maglev_hash_service *, &group->mh_svc) : NULL;
+
+    for (i = 0; i < flows->n; i += cnt) {
+        cnt = MIN(flows->n - i, MH_FLOW_BATCH);
+        n4 = 0;
+        n6 = MH_FLOW_BATCH;
+
+        for (j = 0; j < cnt; j++) {
+            k = i + j;
+
+            if (flows->is_ipv6 && flows->is_ipv6[k]) {
+                n6--;
+                mh_flow_key6(flows, k, &keys[n6]);
+                bases[n6] = mh_proto_basis[flows->protocol[k]];
+                pos[n6] = j;
+            } else {
+                addrs[n4] = flows->src_ip4[k] ^ flows->dst_ip4[k];
+                ports[n4] = flows->src_port[k] ^ flows->dst_port[k];
+                bases[n4] = mh_proto_basis[flows->protocol[k]];
+                pos[n4++] = j;
+            }
+        }
+
+        hash_bytes36_ipv4_batch(addrs, ports, bases, n4, sorted);
+        hash_bytes36_batch(&keys[n6], sizeof keys[0], MH_FLOW_BATCH - n6, &bases[n6], &sorted[n6]);
+
+        if (n4 == cnt) {
+            memcpy(hashes, sorted, cnt * sizeof hashes[0]);
+        } else {
+            for (j = 0; j < n4; j++) {
+                hashes[pos[j]] = sorted[j];
+            }
+            for (j = n6; j < MH_FLOW_BATCH; j++) {
+                hashes[pos[j]] = sorted[j];
+            }
+        }
+
+        mh_lookup_batch_(svc, hashes, cnt, buckets);
+
+        for (j = 0; j < cnt; j++) {
+            bucket_ids[i + j] = buckets[j] ? buckets[j]->bucket_id : MH_BUCKET_ID_NONE;
+        }
+    }
+}
+
+/* Turns the lookup counters on or off and returns the previous setting.
+ * They are off by default: counting adds a few nanoseconds to a lookup, and
+ * the first lookup of each thread through a service allocates its slot of
+ * counters. */
+bool mh_set_stats_enabled(bool enabled)
+{
+    bool old = mh_stats_enabled;
+
+    mh_stats_enabled = enabled;
+    return old;
+}
+
+/* Sums the lookup counters of the current service of 'group' into 'stats',
+ * to be freed with mh_stats_destroy(). The counters start from zero with
+ * each mh_construct(). Returns 0, or -ENOENT if the group has no service. */
+int mh_get_stats(struct group_dpif *group, struct mh_stats *stats)
+{
+    struct maglev_hash_service *svc;
+    struct mh_thread_stats *ts;
+    struct maglev_dest *dest;
+    size_t i;
+
+    memset(stats, 0, sizeof *stats);
+
+    svc = ovsrcu_get(struct maglev_hash_service *, &group->mh_svc);
+    if (!svc)
+        return -ENOENT;
+
+    stats->dests = xcalloc(svc->n_dests, sizeof *stats->dests);
+    if (!stats->dests)
+        return -ENOMEM;
+
+    stats->n_dests = svc->n_dests;
+    LIST_FOR_EACH (dest, n_list, &svc->destinations) {
+        stats->dests[dest->idx - 1].dest_id = dest->dest_id;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(svc->stats); i++) {
+        ts = __atomic_load_n(&svc->stats[i], __ATOMIC_ACQUIRE);
+        if (!ts)
+            continue;
+
+        stats->nulls += __atomic_load_n(&ts->nulls, __ATOMIC_RELAXED);
+        stats->fallbacks += __atomic_load_n(&ts->fallbacks, __ATOMIC_RELAXED);
+        LIST_FOR_EACH (dest, n_list, &svc->destinations) {
+            stats->dests[dest->idx - 1].hits += __atomic_load_n(&ts->hits[dest->idx], __ATOMIC_RELAXED);
+        }
+    }
+
+    stats->lookups = stats->nulls;
+    for (i = 0; i < stats->n_dests; i++) {
+        stats->lookups += stats->dests[i].hits;
+    }
+
+    return 0;
+}
+
+void mh_stats_destroy(struct mh_stats *stats)
+{
+    free(stats->dests);
+    stats->dests = NULL;
+    stats->n_dests = 0;
+}
+
+/* Reports how the lookup table of 'group' is shared among its dests, to be
+ * freed with mh_table_report_destroy(). One pass over the table indices, so
+ * O(table size). Returns 0, or -ENOENT if the group has no table.
+ *
+ * The expected share of a dest is its weight over the weights of the
+ * available dests, out of the non-empty slots. The ratios of the report are
+ * slots / expected of these dests. */
+int mh_get_table_report(struct group_dpif *group, struct mh_table_report *report)
+{
+    struct maglev_hash_service *svc;
+    struct mh_dest_report *dr;
+    struct maglev_dest *dest;
+    struct maglev_state *s;
+    uint32_t *slots, i, k;
+    uint64_t weights = 0;
+    double sum = 0, sum2 = 0;
+    size_t n = 0;
+
+    memset(report, 0, sizeof *report);
+
+    svc = ovsrcu_get(struct maglev_hash_service *, &group->mh_svc);
+    s = svc ? mh_get_state(svc) : NULL;
+    if (!s)
+        return -ENOENT;
+
+    slots = xcalloc(s->n_dests + 1, sizeof *slots);
+    report->dests = xcalloc(s->n_dests, sizeof *report->dests);
+    if (!slots || !report->dests) {
+        free(slots);
+        mh_table_report_destroy(report);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < s->lookup_size; i++) {
+        slots[mh_lookup_index(s, i)]++;
+    }
+
+    report->table_size = s->lookup_size;
+    report->empty = slots[0];
+    report->n_dests = s->n_dests;
+
+    for (k = 1; k <= s->n_dests; k++) {
+        dest = s->dests[k];
+        dr = &report->dests[k - 1];
+        dr->dest_id = dest->dest_id;
+        dr->weight = dest->last_weight;
+        dr->available = !is_unavailable(dest);
+        dr->slots = slots[k];
+        if (dr->available)
+            weights += dr->weight;
+    }
+
+    for (k = 0; k < s->n_dests; k++) {
+        dr = &report->dests[k];
+        if (!dr->available || !dr->weight || !weights)
+            continue;
+
+        dr->expected = (double)(s->lookup_size - report->empty) * dr->weight / weights;
+        dr->ratio = dr->slots / dr->expected;
+
+        if (!n || dr->ratio > report->max_ratio)
+            report->max_ratio = dr->ratio;
+        if (!n || dr->ratio < report->min_ratio)
+            report->min_ratio = dr->ratio;
+
+        sum += dr->ratio;
+        sum2 += dr->ratio * dr->ratio;
+        n++;
+    }
+
+    if (n) {
+        sum /= n;
+        report->stddev = sqrt(MAX(sum2 / n - sum * sum, 0));
+    }
+
+    free(slots);
+    return 0;
+}
+
+void mh_table_report_destroy(struct mh_table_report *report)
+{
+    free(report->dests);
+    report->dests = NULL;
+    report->n_dests = 0;
+}
+
+void mh_log_table_report(const struct mh_table_report *report)
+{
+    const struct mh_dest_report *dr;
+    size_t i;
+
+    for (i = 0; i < report->n_dests; i++) {
+        dr = &report->dests[i];
+        VLOG_INFO("Maglev Dest(%zu): id=%u, weight=%u%s, occupying lookup entry cnt=%u, expected=%.1f, ratio=%.3f",
+                  i, dr->dest_id, dr->weight, dr->available ? "" : " (unavailable)", dr->slots, dr->expected, dr->ratio);
+    }
+
+    VLOG_INFO("Maglev Table: size=%u, empty=%u, dests=%zu, ratio max=%.3f min=%.3f stddev=%.4f",
+              report->table_size, report->empty, report->n_dests,
+              report->max_ratio, report->min_ratio, report->stddev);
+}
@@ -1,7 +1,12 @@
 #ifndef __MAGLEV_HASH_H__
 #define __MAGLEV_HASH_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "list.h"
+#include "rcu.h"
 
 #define MH_FLAG_FALLBACK		  0x0001
 #define MH_DEST_FLAG_DISABLE	  0x0001
@@ -24,36 +29,136 @@ struct maglev_dest {
     uint32_t            flags;          /* dest status flags */ // MH_HASH2_*
     uint32_t            weight;         /* server weight. 0: disable */
     uint32_t            last_weight;    /* same with weight */
+    uint32_t            idx;            /* in the dests[] of the states */
     void                *data;          /* user data */
 };
 
-struct maglev_lookup {
-    struct maglev_dest  *dest;  /* real server (cache) */
+/* Multiply/shift constants that reduce a 32-bit hash modulo a fixed
+ * divisor without a division instruction, so the reduction can also be
+ * done in SIMD lanes (branch-free variant of the libdivide algorithm). */
+struct mh_divider {
+    uint32_t    magic;
+    uint32_t    shift;
+    uint32_t    divisor;
 };
 
+struct maglev_state;
+
+/* Resolves 'n' hashes into the lookup entries they select. */
+typedef void mh_lookup_kernel_fn(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                                 struct maglev_dest **dests);
+
+/* The lookup table stores indices into maglev_state.dests[] instead of
+ * pointers: 16-bit entries while there are at most MH_LOOKUP16_MAX_DESTS
+ * destinations, 32-bit entries beyond that. Index 0 is an empty slot. */
+#define MH_LOOKUP16_MAX_DESTS   UINT16_MAX
+
+/* Resolves one hash into its destination, or NULL. */
+typedef struct maglev_dest *mh_lookup_fn(struct maglev_state *s, uint32_t hash_data);
+
+/* Built aside and immutable once published to readers through
+ * maglev_hash_service.mh_state; freed after an RCU grace period once
+ * replaced.
+ *
+ * The lookup table already accounts for the dests that were unavailable
+ * when it was built: their slots hold the fallback dest, or are empty
+ * without MH_FLAG_FALLBACK. */
 struct maglev_state {
-    //struct ovs_refcount         refcnt;         /* init 1 */
-    uint32_t         refcnt;         /* init 1 */
-    struct maglev_lookup        *lookup;
+    union {
+        void                    *lookup;        /* lookup_size entries, see below */
+        uint16_t                *lookup16;      /* if !lookup_wide */
+        uint32_t                *lookup32;      /* if lookup_wide */
+    };
     uint32_t                    lookup_size;    /* same with table_size */
+    bool                        lookup_wide;    /* 32-bit lookup entries */
+    struct maglev_dest          **dests;        /* [0] = NULL, [1..n_dests] */
+    uint32_t                    n_dests;
     struct maglev_dest_setup    *dest_setup;
     int                         gcd;
     int                         rshift;
+    struct mh_divider           div;            /* hash % lookup_size */
+    mh_lookup_kernel_fn         *lookup_kernel; /* batch lookup, picked by CPU */
+    mh_lookup_fn                *lookup_fn;     /* specialized for the size */
+    unsigned long               *fallback_map;  /* slots of unavailable dests
+                                                 * with a fallback, or NULL */
 };
 
+/* Lookup counters of one thread, see mh_get_stats(). */
+struct mh_thread_stats;
+
+/* Threads with their own counters, the others share one more slot. */
+#define MH_STATS_MAX_THREADS    64
+
 struct maglev_hash_service {
-    //struct ovs_refcount refcnt;         /* init 1 */
-    uint32_t refcnt;         /* init 1 */
     //struct atomic_count version;        /* version number */
     uint32_t            flags;          /* service status flags */
     uint32_t            table_size;     /* should be prime numder */
     struct ovs_list     destinations;   /* real server d-linked list */
-    struct maglev_state *mh_state; 
+    uint32_t            n_dests;        /* in destinations */
+    struct mh_thread_stats *stats[MH_STATS_MAX_THREADS + 1];   /* by thread */
+    OVSRCU_TYPE(struct maglev_state *) mh_state;   /* RCU-protected */
 };
 
+/* Table sizes other than the MH_PRIMES of the size index are rounded up
+ * to a prime, at most MH_TABLE_SIZE_MAX (the largest prime below 2^26). */
+#define MH_TABLE_SIZE_MAX       67108859
+#define MH_TABLE_SLOTS_PER_DEST 100     /* M >= 100 * N, as in the paper */
+#define MH_TABLE_INDEX_MAX      10      /* table size indexes 0 ~ 10 */
+
 struct group_dpif;
 struct ofputil_bucket;
 
+struct mh_dest_stats {
+    uint32_t    dest_id;
+    uint64_t    hits;           /* lookups that selected the dest */
+};
+
+/* Lookup counters of a group, summed over the threads */
+struct mh_stats {
+    uint64_t                lookups;
+    uint64_t                nulls;          /* lookups without dest */
+    uint64_t                fallbacks;      /* lookups of an unavailable dest,
+                                             * served by its fallback */
+    size_t                  n_dests;
+    struct mh_dest_stats    *dests;         /* in the order of the buckets */
+};
+
+/* Time spent in the phases of a table build, in nanoseconds */
+struct mh_build_times {
+    uint64_t    setup;          /* service and dests from the buckets */
+    uint64_t    gcd;            /* gcd and shift of the weights */
+    uint64_t    alloc;          /* lookup table and dests[] */
+    uint64_t    permutate;
+    uint64_t    populate;       /* with the fallback table, if any */
+    uint64_t    total;          /* with the logs and the publication */
+};
+
+struct mh_dest_report {
+    uint32_t    dest_id;
+    uint32_t    weight;
+    bool        available;
+    uint32_t    slots;          /* lookup entries of the dest */
+    double      expected;       /* slots by weight, 0 if unavailable */
+    double      ratio;          /* slots / expected */
+};
+
+/* Distribution of a lookup table among its dests, see mh_get_table_report() */
+struct mh_table_report {
+    uint32_t                table_size;
+    uint32_t                empty;          /* slots without dest */
+    double                  max_ratio;      /* slots / expected, over the */
+    double                  min_ratio;      /* available weighted dests */
+    double                  stddev;         /* of the ratio */
+    size_t                  n_dests;
+    struct mh_dest_report   *dests;         /* in the order of the buckets */
+};
+
+/* Engines filling the lookup table, all giving the same result */
+enum mh_populate_engine {
+    MH_POPULATE_LIST,       /* reference: walks the dest list, probes slot by slot */
+    MH_POPULATE_FAST,       /* dest arrays, word bitmap, inverse-skip dense tail */
+};
+
 //////////////////////
 //
 typedef unsigned int uint32, uint32_t, ovs_be32, u32;
@@ -84,13 +189,49 @@ struct __attribute__((packed)) hash_val {
 
     ovs_be16 tp_port;
 	uint16_t dummy; // for 4 bytes align
-} hash_val;
+};
+
+/* hashed with hash_bytes36() */
+_Static_assert(sizeof(struct hash_val) == 36, "struct hash_val is not 36 bytes");
+
+/* A burst of flows for mh_lookup_flows(), one array of 'n' per field.
+ * The addresses and ports are taken as they are, in network order in the
+ * datapath. */
+struct mh_flow_batch {
+    size_t                  n;
+    const uint8_t           *protocol;
+    const ovs_be32          *src_ip4;       /* IPv4 flows */
+    const ovs_be32          *dst_ip4;
+    const struct in6_addr   *src_ip6;       /* IPv6 flows, NULL if none */
+    const struct in6_addr   *dst_ip6;
+    const uint8_t           *is_ipv6;       /* family of each flow, NULL: all IPv4 */
+    const ovs_be16          *src_port;
+    const ovs_be16          *dst_port;
+};
+
+#define MH_BUCKET_ID_NONE       UINT32_MAX  /* no bucket for the flow */
 
 ////////////////////////////////////////
 
-void                   mh_construct(struct group_dpif *new_group);
+int                    mh_construct(struct group_dpif *new_group);
 void                   mh_destruct(struct group_dpif *group);
 struct ofputil_bucket* mh_lookup(struct group_dpif *group, uint32_t hash_data);
+void                   mh_lookup_batch(struct group_dpif *group, const uint32_t *hashes, size_t n,
+                                       struct ofputil_bucket **buckets);
+void                   mh_lookup_flows(struct group_dpif *group, const struct mh_flow_batch *flows,
+                                       uint32_t *bucket_ids);
+void                   mh_set_populate_engine(enum mh_populate_engine engine);
+void                   mh_set_build_threads(unsigned int n_threads);
+int                    mh_construct_groups(struct group_dpif **groups, size_t n);
+void                   mh_get_build_times(struct mh_build_times *times);
+uint32_t               mh_table_size_for_dests(uint32_t n_dests);
+int                    mh_set_dest_available(struct group_dpif *group, uint32_t bucket_id, bool available);
+bool                   mh_set_stats_enabled(bool enabled);
+int                    mh_get_stats(struct group_dpif *group, struct mh_stats *stats);
+void                   mh_stats_destroy(struct mh_stats *stats);
+int                    mh_get_table_report(struct group_dpif *group, struct mh_table_report *report);
+void                   mh_table_report_destroy(struct mh_table_report *report);
+void                   mh_log_table_report(const struct mh_table_report *report);
 
 
 
@@ -0,0 +1,174 @@
+/* Worker pool for the parallel table builds
+ *
+ * A fixed set of threads waiting for jobs. mh_pool_run() hands the same
+ * function to every thread with its share index, runs share 0 in the
+ * calling thread and returns once all shares are done, so a job is a
+ * parallel loop with an implicit barrier at the end.
+ *
+ * The threads stay parked on a condition variable between jobs: a build
+ * runs a few dozen jobs, which would not pay for creating threads each time.
+ * Jobs must not be submitted from more than one thread at a time.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "maglev_hash_pool.h"
+
+struct mh_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t  wakeup;         /* new job or exit */
+    pthread_cond_t  done;           /* last share of a job finished */
+    unsigned int    n_threads;      /* shares per job, with the caller */
+    pthread_t       *threads;       /* n_threads - 1 workers */
+
+    uint64_t        job_seq;        /* bumped for each job */
+    unsigned int    n_running;      /* worker shares not done yet */
+    mh_pool_fn      *fn;
+    void            *aux;
+    bool            exiting;
+};
+
+struct mh_pool_worker {
+    struct mh_pool  *pool;
+    unsigned int    idx;
+};
+
+static void* mh_pool_main(void *arg)
+{
+    struct mh_pool_worker *worker = arg;
+    struct mh_pool *pool = worker->pool;
+    unsigned int idx = worker->idx;
+    uint64_t seen = 0;
+    mh_pool_fn *fn;
+    void *aux;
+
+    free(worker);
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->job_seq == seen && !pool->exiting)
+            pthread_cond_wait(&pool->wakeup, &pool->mutex);
+
+        if (pool->exiting)
+            break;
+
+        seen = pool->job_seq;
+        fn = pool->fn;
+        aux = pool->aux;
+        pthread_mutex_unlock(&pool->mutex);
+
+        fn(aux, idx, pool->n_threads);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->n_running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/* Creates a pool running jobs in 'n_threads' shares: the calling thread
+ * plus n_threads - 1 workers. */
+struct mh_pool* mh_pool_create(unsigned int n_threads)
+{
+    struct mh_pool_worker *worker;
+    struct mh_pool *pool;
+    unsigned int i;
+
+    if (n_threads < 1)
+        n_threads = 1;
+
+    pool = calloc(1, sizeof *pool);
+    if (!pool)
+        return NULL;
+
+    pool->threads = calloc(n_threads, sizeof *pool->threads);
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->n_threads = 1;
+
+    for (i = 1; i < n_threads; i++) {
+        worker = malloc(sizeof *worker);
+        if (!worker)
+            break;
+
+        worker->pool = pool;
+        worker->idx = i;
+        if (pthread_create(&pool->threads[i - 1], NULL, mh_pool_main, worker)) {
+            free(worker);
+            break;
+        }
+
+        pool->n_threads++;
+    }
+
+    if (pool->n_threads < n_threads) {
+        VLOG_WARN("Maglev build pool: started %u of %u threads", pool->n_threads, n_threads);
+    }
+
+    return pool;
+}
+
+void mh_pool_destroy(struct mh_pool *pool)
+{
+    unsigned int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->exiting = true;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i + 1 < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+unsigned int mh_pool_size(const struct mh_pool *pool)
+{
+    return pool ? pool->n_threads : 1;
+}
+
+/* Runs fn(aux, idx, n) for every idx in [0, n), n being the pool size, and
+ * waits for all of them. Share 0 runs in the calling thread. */
+void mh_pool_run(struct mh_pool *pool, mh_pool_fn *fn, void *aux)
+{
+    if (!pool || pool->n_threads == 1) {
+        fn(aux, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->aux = aux;
+    pool->n_running = pool->n_threads - 1;
+    pool->job_seq++;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->mutex);
+
+    fn(aux, 0, pool->n_threads);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->n_running)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
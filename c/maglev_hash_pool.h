@@ -0,0 +1,16 @@
+#ifndef __MAGLEV_HASH_POOL_H__
+#define __MAGLEV_HASH_POOL_H__
+
+/* Worker pool for the parallel table builds, see maglev_hash_pool.c. */
+
+struct mh_pool;
+
+/* Runs share 'idx' of 'n' of a parallel job. */
+typedef void mh_pool_fn(void *aux, unsigned int idx, unsigned int n);
+
+struct mh_pool* mh_pool_create(unsigned int n_threads);
+void            mh_pool_destroy(struct mh_pool *pool);
+unsigned int    mh_pool_size(const struct mh_pool *pool);
+void            mh_pool_run(struct mh_pool *pool, mh_pool_fn *fn, void *aux);
+
+#endif
@@ -0,0 +1,147 @@
+/* SIMD lookup kernels for the Maglev lookup table
+ *
+ * Each kernel resolves a batch of flow hashes into the destinations they
+ * select, 8 (AVX2) or 16 (AVX-512) hashes at a time. The reduction modulo
+ * lookup_size is done in the vector lanes with the multiply/shift constants
+ * of s->div, then the 16/32-bit lookup entries and the dests[] pointers
+ * they index are fetched with hardware gathers, so many independent table
+ * reads are in flight at once.
+ *
+ * The result is the same as mh_get_lookup_dest() for every hash.
+ * The kernels are compiled with target attributes and must only be called
+ * after checking the CPU (see mh_select_lookup_kernel()).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+#include "maglev_hash_utils.h"
+#include "maglev_hash.h"
+#include "maglev_hash_simd.h"
+
+#if defined(MH_HAVE_SIMD_KERNELS)
+
+#include <immintrin.h>
+
+static inline void mh_lookup_tail(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                                  struct maglev_dest **dests)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dests[i] = s->dests[mh_lookup_index(s, mh_divider_mod(&s->div, hashes[i]))];
+    }
+}
+
+///////////////////////////////////////////
+// AVX2: 8 lanes
+
+__attribute__((target("avx2")))
+static inline __m256i mh_mod_avx2(__m256i n, __m256i magic, __m128i shift, __m256i d)
+{
+    __m256i even, odd, q, t;
+
+    /* q = mulhi(n, magic) */
+    even = _mm256_srli_epi64(_mm256_mul_epu32(n, magic), 32);
+    odd = _mm256_mul_epu32(_mm256_srli_epi64(n, 32), magic);
+    q = _mm256_blend_epi32(even, odd, 0xaa);
+
+    /* n - (((n - q) >> 1) + q) >> shift) * d */
+    t = _mm256_add_epi32(_mm256_srli_epi32(_mm256_sub_epi32(n, q), 1), q);
+    t = _mm256_srl_epi32(t, shift);
+
+    return _mm256_sub_epi32(n, _mm256_mullo_epi32(t, d));
+}
+
+/* 16-bit entries are gathered 32 bits at a time and masked; the lookup
+ * table has a spare entry so the last slot can be read this way. */
+__attribute__((target("avx2")))
+static inline __m256i mh_index_avx2(const struct maglev_state *s, __m256i slot)
+{
+    if (s->lookup_wide)
+        return _mm256_i32gather_epi32((const int *)s->lookup32, slot, sizeof(uint32_t));
+
+    return _mm256_and_si256(_mm256_i32gather_epi32((const int *)s->lookup16, slot, sizeof(uint16_t)),
+                            _mm256_set1_epi32(0xffff));
+}
+
+__attribute__((target("avx2")))
+void mh_lookup_kernel_avx2(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                           struct maglev_dest **dests)
+{
+    const long long *base = (const long long *)s->dests;
+    const __m256i magic = _mm256_set1_epi32(s->div.magic);
+    const __m128i shift = _mm_cvtsi32_si128(s->div.shift);
+    const __m256i d = _mm256_set1_epi32(s->div.divisor);
+    __m256i h, idx, lo, hi;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        h = _mm256_loadu_si256((const __m256i *)&hashes[i]);
+        idx = mh_index_avx2(s, mh_mod_avx2(h, magic, shift, d));
+
+        lo = _mm256_i32gather_epi64(base, _mm256_castsi256_si128(idx), sizeof(struct maglev_dest *));
+        hi = _mm256_i32gather_epi64(base, _mm256_extracti128_si256(idx, 1), sizeof(struct maglev_dest *));
+
+        _mm256_storeu_si256((__m256i *)&dests[i], lo);
+        _mm256_storeu_si256((__m256i *)&dests[i + 4], hi);
+    }
+
+    mh_lookup_tail(s, hashes + i, n - i, dests + i);
+}
+
+///////////////////////////////////////////
+// AVX-512: 16 lanes
+
+__attribute__((target("avx512f")))
+static inline __m512i mh_mod_avx512(__m512i n, __m512i magic, __m128i shift, __m512i d)
+{
+    __m512i even, odd, q, t;
+
+    even = _mm512_srli_epi64(_mm512_mul_epu32(n, magic), 32);
+    odd = _mm512_mul_epu32(_mm512_srli_epi64(n, 32), magic);
+    q = _mm512_mask_blend_epi32(0xaaaa, even, odd);
+
+    t = _mm512_add_epi32(_mm512_srli_epi32(_mm512_sub_epi32(n, q), 1), q);
+    t = _mm512_srl_epi32(t, shift);
+
+    return _mm512_sub_epi32(n, _mm512_mullo_epi32(t, d));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i mh_index_avx512(const struct maglev_state *s, __m512i slot)
+{
+    if (s->lookup_wide)
+        return _mm512_i32gather_epi32(slot, s->lookup32, sizeof(uint32_t));
+
+    return _mm512_and_si512(_mm512_i32gather_epi32(slot, s->lookup16, sizeof(uint16_t)),
+                            _mm512_set1_epi32(0xffff));
+}
+
+__attribute__((target("avx512f")))
+void mh_lookup_kernel_avx512(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                             struct maglev_dest **dests)
+{
+    const void *base = s->dests;
+    const __m512i magic = _mm512_set1_epi32(s->div.magic);
+    const __m128i shift = _mm_cvtsi32_si128(s->div.shift);
+    const __m512i d = _mm512_set1_epi32(s->div.divisor);
+    __m512i h, idx, lo, hi;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        h = _mm512_loadu_si512(&hashes[i]);
+        idx = mh_index_avx512(s, mh_mod_avx512(h, magic, shift, d));
+
+        lo = _mm512_i32gather_epi64(_mm512_castsi512_si256(idx), base, sizeof(struct maglev_dest *));
+        hi = _mm512_i32gather_epi64(_mm512_extracti64x4_epi64(idx, 1), base, sizeof(struct maglev_dest *));
+
+        _mm512_storeu_si512(&dests[i], lo);
+        _mm512_storeu_si512(&dests[i + 8], hi);
+    }
+
+    mh_lookup_tail(s, hashes + i, n - i, dests + i);
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __MAGLEV_HASH_SIMD_H__
+#define __MAGLEV_HASH_SIMD_H__
+
+#include "maglev_hash.h"
+
+/* Vectorized lookup kernels, see maglev_hash_simd.c.
+ * Only available on x86_64; the caller checks the CPU before using them. */
+#if defined(__x86_64__)
+#define MH_HAVE_SIMD_KERNELS 1
+
+void mh_lookup_kernel_avx2(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                           struct maglev_dest **dests);
+void mh_lookup_kernel_avx512(const struct maglev_state *s, const uint32_t *hashes, size_t n,
+                             struct maglev_dest **dests);
+#endif
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef __MAGLEV_HASH_UTILS_H__
 #define __MAGLEV_HASH_UTILS_H__
 
+#include "maglev_hash.h"
+
 #ifdef _MH_DEBUG
 # define dbg_print(fmt, ...) do { \
         VLOG_INFO("%s:%d:%s: " fmt, __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
@@ -71,33 +73,150 @@ static inline unsigned long gcd(unsigned long a, unsigned long b)
     return b;
 }
 
-static inline uint32_t ovs_refcount_read(uint32_t *refcnt) {
-	if (refcnt != NULL) {
-		return *refcnt;
-	}
+static inline uint32_t pow_mod(uint32_t b, uint32_t e, uint32_t m)
+{
+    uint64_t r = 1, x = b % m;
+
+    while (e) {
+        if (e & 1)
+            r = r * x % m;
+        x = x * x % m;
+        e >>= 1;
+    }
 
-	return 0;
+    return r;
 }
 
-static inline void ovs_refcount_ref(uint32_t *refcnt) {
-	if (refcnt != NULL) {
-		(*refcnt) ++;
-	}
+/* Deterministic Miller-Rabin: the bases 2, 7 and 61 have no common strong
+ * pseudoprime below 4759123141, so the answer is exact for any uint32_t. */
+static inline bool is_prime(uint32_t n)
+{
+    static const uint32_t small[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61 };
+    static const uint32_t bases[] = { 2, 7, 61 };
+    uint32_t d, r, x, i, j;
+
+    if (n < 2)
+        return false;
+
+    for (i = 0; i < ARRAY_SIZE(small); i++) {
+        if (n % small[i] == 0)
+            return n == small[i];
+    }
+
+    for (d = n - 1, r = 0; !(d & 1); d >>= 1)
+        r++;
+
+    for (i = 0; i < ARRAY_SIZE(bases); i++) {
+        x = pow_mod(bases[i], d, n);
+        if (x == 1 || x == n - 1)
+            continue;
+
+        for (j = 1; j < r; j++) {
+            x = (uint64_t)x * x % n;
+            if (x == n - 1)
+                break;
+        }
+
+        if (j == r)
+            return false;
+    }
+
+    return true;
 }
 
-/* Decrements 'refcount' and returns the previous reference count.  Often used
- * in this form:
- */
-static inline uint32_t ovs_refcount_unref(uint32_t *refcnt) {
-	if (refcnt == NULL) {
-		return 0;
-	}
+/* Returns the smallest prime >= 'n', for n below the largest 32-bit prime. */
+static inline uint32_t next_prime(uint32_t n)
+{
+    if (n <= 2)
+        return 2;
+
+    for (n |= 1; !is_prime(n); n += 2)
+        ;
+
+    return n;
+}
 
-	uint32_t old = *refcnt;
+/* Returns the inverse of 'a' modulo 'm', or 0 if 'a' and 'm' are not
+ * coprime. */
+static inline uint32_t inverse_mod(uint32_t a, uint32_t m)
+{
+    int64_t t = 0, new_t = 1, q, tmp;
+    uint32_t r = m, new_r = a % m, rtmp;
+
+    while (new_r) {
+        q = r / new_r;
+
+        tmp = t - q * new_t;
+        t = new_t;
+        new_t = tmp;
+
+        rtmp = r - q * new_r;
+        r = new_r;
+        new_r = rtmp;
+    }
 
-	(*refcnt) --;
+    if (r != 1)
+        return 0;
 
-	return old;
+    return t < 0 ? t + m : t;
+}
+
+/* Prepares 'div' to compute 'n % d' for any 32-bit 'n'. 'd' must be > 1. */
+static inline void mh_divider_init(struct mh_divider *div, uint32_t d)
+{
+    uint32_t l = 31 - count_of_leading_0_bits(d);  /* floor(log2(d)) */
+    uint64_t num;
+    uint32_t m, rem, twice_rem;
+
+    div->divisor = d;
+
+    if (IS_POW2(d)) {
+        div->magic = 0;
+        div->shift = l - 1;
+        return;
+    }
+
+    /* m = floor(2^(32+l) / d) fits in 32 bits because d > 2^l. The
+     * branch-free form uses a 33-bit multiplier whose top bit is implied
+     * by the (n - q) / 2 + q step in mh_divider_mod(). */
+    num = (uint64_t)1 << (32 + l);
+    m = num / d;
+    rem = num % d;
+
+    twice_rem = rem + rem;
+    m += m;
+    if (twice_rem >= d || twice_rem < rem)
+        m += 1;
+
+    div->magic = m + 1;
+    div->shift = l;
+}
+
+static inline uint32_t mh_divider_mod(const struct mh_divider *div, uint32_t n)
+{
+    uint32_t q = ((uint64_t)div->magic * n) >> 32;
+    uint32_t t = ((n - q) >> 1) + q;
+
+    return n - (t >> div->shift) * div->divisor;
+}
+
+/* Returns the dests[] index stored in lookup table 'slot'. */
+static inline uint32_t mh_lookup_index(const struct maglev_state *s, uint32_t slot)
+{
+    return s->lookup_wide ? s->lookup32[slot] : s->lookup16[slot];
+}
+
+static inline void mh_set_lookup_index(struct maglev_state *s, uint32_t slot, uint32_t idx)
+{
+    if (s->lookup_wide)
+        s->lookup32[slot] = idx;
+    else
+        s->lookup16[slot] = idx;
+}
+
+static inline size_t mh_lookup_entry_size(const struct maglev_state *s)
+{
+    return s->lookup_wide ? sizeof(uint32_t) : sizeof(uint16_t);
 }
 
 #endif
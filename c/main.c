@@ -1,17 +1,22 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <smmintrin.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "list.h"
+#include "churn.h"
 #include "hash.h"
 #include "jhash.h"
 #include "group.h"
 #include "log.h"
 #include "maglev_hash.h"
+#include "maglev_hash_pool.h"
+#include "rcu.h"
 #include "test_vector.h"
 
 
@@ -39,6 +44,10 @@ int verify_crc32() {
     crc = hash_add2(0, hash_data);
     VLOG_INFO("SW2 CRC   : 0x%x, 0x%x expect=0x%x", hash_data, crc, expected);
 
+    crc = 0;
+    crc = hash_add3(0, hash_data);
+    VLOG_INFO("SW8 CRC   : 0x%x, 0x%x expect=0x%x", hash_data, crc, expected);
+
     ////////////////////////////////////////
     // standard reflected verion
     // CRC32C with reflected is not the same with hash_byte above
@@ -83,6 +92,10 @@ int verify_hash_byte() {
     hash = hash_bytes2(&message, len, hash); 
     VLOG_INFO("Software2 : 0x%x, 0x%x expect=0x%x", message, hash, expected_hash);
 
+    hash = 0;
+    hash = hash_bytes3(&message, len, hash); 
+    VLOG_INFO("Software8 : 0x%x, 0x%x expect=0x%x", message, hash, expected_hash);
+
     return 0;
 }
 
@@ -272,18 +285,24 @@ uint32_t get_hash(struct tv_entry *in) {
     uint8_t protocol = in->protocol;
 
     // ip
-    hval.pkt.ipv4_addr ^= in->sip;
-    hval.pkt.ipv4_addr ^= in->dip;
+    if (in->is_ipv6) {
+        for (size_t i = 0; i < sizeof hval.pkt.ipv6_addr; i++) {
+            hval.pkt.ipv6_addr.s6_addr[i] = in->sip6.s6_addr[i] ^ in->dip6.s6_addr[i];
+        }
+    } else {
+        hval.pkt.ipv4_addr ^= in->sip;
+        hval.pkt.ipv4_addr ^= in->dip;
+    }
 
     // protocol
-    hash = hash_bytes1(&protocol, sizeof protocol, hash); 
+    hash = hash_bytes(&protocol, sizeof protocol, hash); 
 
     // port
     hval.tp_port ^= in->sport;
     hval.tp_port ^= in->dport;
 
     // finallize hash
-    hash = hash_bytes1(&hval, sizeof(hval), hash);
+    hash = hash_bytes36(&hval, hash);
 
     return hash;
 }
@@ -314,7 +333,82 @@ void free_bucket(struct group_dpif *group) {
     }
 }
 
-void maglev_verify(test_vector_t *tv) {
+/* A verification, its flows split in one share per thread of the pool */
+struct verify_job {
+    struct group_dpif       *group;
+    const test_vector_t     *tv;
+    uint32_t                cross_check;    /* every nth flow, 0: none */
+    struct {
+        uint32_t            mismatched;
+        uint32_t            diverged;   /* mh_lookup() selected another bucket */
+    } *shares;
+};
+
+#define VERIFY_CHUNK 4096   /* flows looked up at a time */
+
+static void maglev_verify_share(void *aux, unsigned int idx, unsigned int n)
+{
+    struct verify_job *job = aux;
+    const test_vector_t *tv = job->tv;
+    uint32_t begin = (uint64_t)tv->num_tv_entries * idx / n;
+    uint32_t end = (uint64_t)tv->num_tv_entries * (idx + 1) / n;
+    uint32_t bucket_ids[VERIFY_CHUNK];
+    uint32_t mismatched = 0, diverged = 0;
+    struct ofputil_bucket *bkt;
+    struct tv_entry entry;
+    uint32_t calc_hash;
+    uint32_t i, j;
+    bool was_quiescent = ovsrcu_is_quiescent();
+
+    ovsrcu_quiesce_end();
+
+    for (i = begin; i < end; i += VERIFY_CHUNK) {
+        // the test vector holds the flows as the datapath hands them over
+        struct mh_flow_batch flows = {
+            .n = MIN(end - i, VERIFY_CHUNK),
+            .protocol = tv->protocol + i,
+            .src_ip4 = tv->sip + i,
+            .dst_ip4 = tv->dip + i,
+            .src_ip6 = tv->sip6 ? tv->sip6 + i : NULL,
+            .dst_ip6 = tv->dip6 ? tv->dip6 + i : NULL,
+            .is_ipv6 = tv->is_ipv6 ? tv->is_ipv6 + i : NULL,
+            .src_port = tv->sport + i,
+            .dst_port = tv->dport + i,
+        };
+
+        mh_lookup_flows(job->group, &flows, bucket_ids);
+
+        for (j = 0; j < flows.n; j++) {
+            if (bucket_ids[j] != tv->bkt_id[i + j]) {
+                mismatched ++;
+            }
+
+            // the per-flow path must select the same buckets
+            if (!job->cross_check || (i + j) % job->cross_check) {
+                continue;
+            }
+            tv_get_entry(tv, i + j, &entry);
+            calc_hash = get_hash(&entry);
+            bkt = mh_lookup(job->group, calc_hash);
+            if ((bkt ? bkt->bucket_id : MH_BUCKET_ID_NONE) != bucket_ids[j]) {
+                diverged ++;
+            }
+        }
+    }
+
+    job->shares[idx].mismatched = mismatched;
+    job->shares[idx].diverged = diverged;
+
+    /* without a pool, the share runs in the caller, which may read on */
+    if (was_quiescent) {
+        ovsrcu_quiesce_start();
+    }
+}
+
+/* Verifies the buckets mh_lookup_flows() selects for the flows of 'tv', and
+ * cross-checks every 'cross_check'th one (0: none) against mh_lookup().
+ * Returns 0, or -ENOMEM if the flows could not be verified. */
+int maglev_verify(test_vector_t *tv, struct mh_pool *pool, uint32_t cross_check) {
     VLOG_INFO("Start verifying Maglev: Hash2=%s, GroupId=%d, hash_tab_idx=%d, num_bkts=%d, bkt_weight=%d, num_tv=%d", 
               tv->maglev_hash2,
               tv->maglev_id,
@@ -343,71 +437,296 @@ void maglev_verify(test_vector_t *tv) {
 
     mh_construct(&group);
 
-    struct tv_entry *entry;
-    uint32_t calc_hash;
-    uint32_t idx=0;
+    struct mh_table_report report;
+    if (VLOG_IS_INFO_ENABLED() && mh_get_table_report(&group, &report) == 0) {
+        mh_log_table_report(&report);
+        mh_table_report_destroy(&report);
+    }
+
+    struct verify_job job = { .group = &group, .tv = tv, .cross_check = cross_check };
+
+    job.shares = calloc(mh_pool_size(pool), sizeof *job.shares);
+    if (job.shares == NULL) {
+        VLOG_ERROR("failed to alloc the verify shares");
+        mh_destruct(&group);
+        free_bucket(&group);
+        ovsrcu_quiesce();
+        return -ENOMEM;
+    }
 
     // verify them
     VLOG_INFO("Verify Maglev Hash result");
 
-    struct ofputil_bucket *bkt;
-    LIST_FOR_EACH (entry, node, &tv->tv_list) {
-        idx ++;
-        calc_hash = get_hash(entry);
-
-        bkt = mh_lookup(&group, calc_hash);
-        if (bkt->bucket_id != entry->bkt_id) {
-#if 0
-            VLOG_INFO("%d: mismatched: bkt_id=%d:%d hash=0x%x:0x%x", idx, 
-                      bkt->bucket_id, entry->bkt_id,
-                      calc_hash, entry->hash);
-#endif
+    mh_pool_run(pool, maglev_verify_share, &job);
 
-            tv->mismatched ++;
-        }
+    uint32_t diverged = 0;
+    for (unsigned int i = 0; i < mh_pool_size(pool); i++) {
+        tv->mismatched += job.shares[i].mismatched;
+        diverged += job.shares[i].diverged;
+    }
+    free(job.shares);
 
+    if (diverged) {
+        VLOG_WARN("mh_lookup_flows() and mh_lookup() disagree on %d flows", diverged);
     }
 
-    VLOG_INFO("Verification Result: Total=%d, Mismatched=%d", idx, tv->mismatched);
+    VLOG_INFO("Verification Result: Total=%d, Mismatched=%d", tv->num_tv_entries, tv->mismatched);
 
     mh_destruct(&group);
     free_bucket(&group);
 
+    /* no Maglev state is held any more: let RCU free the old ones */
+    ovsrcu_quiesce();
+
     VLOG_INFO("End maglev test ");
+
+    return 0;
 }
 
 void print_usage(char *pgname) {
-    printf("usage: %s [-h] [-v] [-n name]\n", pgname);
+    printf("usage: %s [-h] [-e engine] [-t num] [-x num] [-f name]... [-w name] [-c script] [-R num] [-s seed] [-S]\n", pgname);
     printf("options:\n");
     printf("  -h       : print this help  \n");
-    printf("  -f [name]: test vector file name. \n");
+    printf("  -e [name]: flow hash engine: auto, sse4.2-u64, sse4.2, slice8, table, bitwise\n");
+    printf("  -f [name]: test vector file name, text or binary (-w). \n");
+    printf("             several -f: the files are verified concurrently\n");
+    printf("  -t [num] : threads verifying each test vector, 1 by default\n");
+    printf("  -x [num] : cross-check every num-th flow with mh_lookup(), none by default\n");
+    printf("  -w [name]: write the test vector (one -f) in the binary format and exit\n");
+    printf("  -c [name]: churn simulation: group and events script (see churn.c)\n");
+    printf("  -R [num] : churn simulation: random events after the script ones\n");
+    printf("  -s [seed]: churn simulation: seed of the random events and flows\n");
+    printf("  -S       : churn simulation: count the lookups, print the counters by bucket\n");
+}
+
+int churn_main(char *script_file, uint32_t n_random, uint32_t seed, bool count_lookups) {
+    struct churn_script cs;
+    int ret = 0;
+
+    churn_script_init(&cs);
+    if (script_file != NULL) {
+        ret = churn_load_script(&cs, script_file);
+    }
+
+    if (ret == 0) {
+        /* the per-build logs would bury the report */
+        current_log_level = LOG_LEVEL_WARN;
+        ret = churn_run(&cs, n_random, seed, get_hash, count_lookups);
+    }
+
+    churn_script_destroy(&cs);
+
+    return ret ? 1 : 0;
+}
+
+
+/* The verifications of a test vector: its group as in the file, then with
+ * buckets added and removed */
+static const struct {
+    const char  *title;
+    uint32_t    num_buckets;    /* 0: as in the file */
+} verify_steps[] = {
+    { "step 1", 0 },
+    { "step 2, adding 1 target", 4 },
+    { "step 4, adding 2 target", 5 },
+    { "step 5, adding 3 target", 6 },
+    { "step 5, deleting 1 target", 2 },
+};
+
+/* A test vector file verified by verify_file(), in its own thread when
+ * there are several */
+struct verify_file {
+    const char      *name;
+    unsigned int    n_threads;
+    uint32_t        cross_check;    /* see maglev_verify() */
+    pthread_t       thread;
+    int             ret;            /* 0, 1 if it could not be loaded or
+                                     * verified */
+    uint32_t        n_flows;
+    uint32_t        mismatched[ARRAY_SIZE(verify_steps)];
+    double          seconds;
+};
+
+static double verify_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int verify_file(struct verify_file *vf)
+{
+    double t0 = verify_now();
+    struct mh_pool *pool = NULL;
+    int ret = 0;
+    size_t i;
+
+    // load test vectors to be verified
+    test_vector_t *tv = load_test_vector((char *)vf->name);
+    if (tv == NULL) {
+        return 1;
+    }
+
+    if (vf->n_threads > 1) {
+        pool = mh_pool_create(vf->n_threads);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(verify_steps); i++) {
+        VLOG_INFO("");
+        VLOG_INFO("Start verifying maglev: %s", verify_steps[i].title);
+        tv->mismatched = 0;
+        if (verify_steps[i].num_buckets) {
+            tv->num_buckets = verify_steps[i].num_buckets;
+        }
+        if (maglev_verify(tv, pool, vf->cross_check)) {
+            ret = 1;
+            break;
+        }
+        vf->mismatched[i] = tv->mismatched;
+    }
+
+    vf->n_flows = tv->num_tv_entries;
+    vf->seconds = verify_now() - t0;
+
+    mh_pool_destroy(pool);
+    free_test_vector(tv);
+
+    return ret;
 }
 
+static void* verify_file_main(void *vf_)
+{
+    struct verify_file *vf = vf_;
+
+    vf->ret = verify_file(vf);
+    ovsrcu_quiesce_start();
+
+    return NULL;
+}
+
+/* Verifies the 'n' files concurrently, one thread each. */
+static int verify_files(struct verify_file *files, size_t n)
+{
+    int ret = 0;
+    size_t i, j;
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&files[i].thread, NULL, verify_file_main, &files[i])) {
+            VLOG_WARN("%s: no thread, verified after the others", files[i].name);
+            files[i].thread = pthread_self();
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (pthread_equal(files[i].thread, pthread_self())) {
+            files[i].ret = verify_file(&files[i]);
+        } else {
+            pthread_join(files[i].thread, NULL);
+        }
+    }
+
+    /* the logs of the files are mixed: sum them up in order */
+    VLOG_INFO("");
+    for (i = 0; i < n; i++) {
+        char steps[ARRAY_SIZE(verify_steps) * 11 + 1] = "";
+
+        if (files[i].ret) {
+            VLOG_WARN("%s: not verified", files[i].name);
+            ret = 1;
+            continue;
+        }
+
+        for (j = 0; j < ARRAY_SIZE(verify_steps); j++) {
+            sprintf(steps + strlen(steps), "%s%u", j ? "/" : "", files[i].mismatched[j]);
+        }
+        VLOG_INFO("%s: Total=%u, Mismatched=%s by step, %.3f s", files[i].name,
+                  files[i].n_flows, steps, files[i].seconds);
+    }
+
+    return ret;
+}
 
 int main(int argc, char *argv[]) {
     int opt;
-    char *test_vect_file = NULL;
+    struct verify_file *files = calloc(argc, sizeof *files);
+    size_t n_files = 0;
+    unsigned int n_threads = 1;
+    uint32_t cross_check = 0;
+    char *bin_file = NULL;
+    char *churn_file = NULL;
+    uint32_t churn_random = 0, churn_seed = 1;
+    bool churn_stats = false;
+    int engine;
+    int ret = 0;
+
+    if (files == NULL) {
+        VLOG_ERROR("failed to alloc the test vector files");
+        return 1;
+    }
 
-    while ((opt = getopt(argc, argv, "hf:")) != -1) {
+    while ((opt = getopt(argc, argv, "he:f:t:x:w:c:R:s:S")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
-                return 0;
+                goto out;
+            case 'e':
+                engine = hash_engine_from_name(optarg);
+                if (engine < 0 || hash_set_engine(engine) < 0) {
+                    VLOG_WARN("flow hash engine %s not supported", optarg);
+                    ret = 1;
+                    goto out;
+                }
+                break;
             case 'f':
-                test_vect_file = optarg;
+                files[n_files++].name = optarg;
+                break;
+            case 't':
+                n_threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                cross_check = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                bin_file = optarg;
+                break;
+            case 'c':
+                churn_file = optarg;
+                break;
+            case 'R':
+                churn_random = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                churn_seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                churn_stats = true;
                 break;
             case '?':
                 print_usage(argv[0]);
-                return 1;
+                ret = 1;
+                goto out;
         }
     }
 
-    if (test_vect_file == NULL) {
+    if (churn_file != NULL || churn_random > 0) {
+        ret = churn_main(churn_file, churn_random, churn_seed, churn_stats);
+        goto out;
+    }
+
+    if (n_files == 0) {
         VLOG_WARN("test vector file name required");
-        return 1;
+        ret = 1;
+        goto out;
+    }
+    if (bin_file != NULL && n_files > 1) {
+        VLOG_WARN("-w converts one test vector file");
+        ret = 1;
+        goto out;
     }
 
     VLOG_INFO("Start maglev simulater ");
+    VLOG_INFO("flow hash engine: %s", hash_engine_name(hash_get_engine()));
 
 #if 0
     // verify code
@@ -420,44 +739,33 @@ int main(int argc, char *argv[]) {
     //verify_murmur_hash_bytes();
 #endif
 
-    // verify test vector
-    // load test vectors to be verified
-    test_vector_t *tv = load_test_vector(test_vect_file);
-    if (tv == NULL) {
-        return 1;
-    }
-
-    VLOG_INFO("");
-    VLOG_INFO("Start verifying maglev: step 1");
-    maglev_verify(tv);
-
-    VLOG_INFO("");
-    VLOG_INFO("Start verifying maglev: step 2, adding 1 target");
-    tv->mismatched = 0;
-    tv->num_buckets = 4;
-    maglev_verify(tv);
-
-    VLOG_INFO("");
-    VLOG_INFO("Start verifying maglev: step 4, adding 2 target");
-    tv->mismatched = 0;
-    tv->num_buckets = 5;
-    maglev_verify(tv);
+    if (bin_file != NULL) {
+        test_vector_t *tv = load_test_vector((char *)files[0].name);
+        if (tv == NULL) {
+            ret = 1;
+            goto out;
+        }
 
-    VLOG_INFO("");
-    VLOG_INFO("Start verifying maglev: step 5, adding 3 target");
-    tv->mismatched = 0;
-    tv->num_buckets = 6;
-    maglev_verify(tv);
+        ret = save_test_vector_bin(tv, bin_file) ? 1 : 0;
 
-    VLOG_INFO("");
-    VLOG_INFO("Start verifying maglev: step 5, deleting 1 target");
-    tv->mismatched = 0;
-    tv->num_buckets  = 2;
-    maglev_verify(tv);
+        free_test_vector(tv);
+        goto out;
+    }
 
-    free_test_vector(tv);
+    // verify test vector
+    for (size_t i = 0; i < n_files; i++) {
+        files[i].n_threads = MAX(n_threads, 1);
+        files[i].cross_check = cross_check;
+    }
+    if (n_files == 1) {
+        ret = verify_file(&files[0]);
+    } else {
+        ret = verify_files(files, n_files);
+    }
 
     VLOG_INFO("End maglev simulater ");
 
-    return 0;
+out:
+    free(files);
+    return ret;
 }
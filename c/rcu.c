@@ -0,0 +1,227 @@
+/* Read-Copy-Update with quiescent-state based reclamation
+ *
+ * Every thread that reads RCU-protected pointers owns a cache-line sized
+ * slot holding the global sequence number it saw at its last quiescent
+ * point, or OVSRCU_QUIESCENT while it holds no pointer at all. Quiescing
+ * only writes the thread's own slot, so readers never bounce a shared
+ * cache line between cores.
+ *
+ * ovsrcu_postpone() bumps the global sequence number and queues the
+ * callback with the new value. A callback is safe to run once every
+ * non-quiescent thread has a sequence number at least as large: those
+ * threads have passed a quiescent point after the pointer was unpublished.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+#include "log.h"
+#include "rcu.h"
+
+#define OVSRCU_CACHE_LINE_SIZE 64
+#define OVSRCU_QUIESCENT UINT64_MAX
+
+struct ovsrcu_perthread {
+    struct ovs_list list_node;  /* In 'ovsrcu_threads'. */
+    uint64_t seqno;             /* Seqno at last quiescent point, or
+                                 * OVSRCU_QUIESCENT. */
+} __attribute__((aligned(OVSRCU_CACHE_LINE_SIZE)));
+
+struct ovsrcu_cb {
+    struct ovs_list list_node;  /* In 'ovsrcu_cbs', in seqno order. */
+    void (*function)(void *aux);
+    void *aux;
+    uint64_t seqno;
+};
+
+/* Protects 'ovsrcu_threads' and 'ovsrcu_cbs'. */
+static pthread_mutex_t ovsrcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ovs_list ovsrcu_threads = OVS_LIST_INITIALIZER(&ovsrcu_threads);
+static struct ovs_list ovsrcu_cbs = OVS_LIST_INITIALIZER(&ovsrcu_cbs);
+static uint32_t ovsrcu_n_cbs;   /* Lets quiescing skip the mutex. */
+
+static uint64_t ovsrcu_seqno = 1;
+
+static pthread_once_t ovsrcu_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ovsrcu_key;
+__thread struct ovsrcu_perthread *ovsrcu_self;
+
+static void ovsrcu_unregister(void *perthread_)
+{
+    struct ovsrcu_perthread *perthread = perthread_;
+
+    pthread_mutex_lock(&ovsrcu_mutex);
+    ovs_list_remove(&perthread->list_node);
+    pthread_mutex_unlock(&ovsrcu_mutex);
+
+    free(perthread);
+}
+
+static void ovsrcu_init_module(void)
+{
+    pthread_key_create(&ovsrcu_key, ovsrcu_unregister);
+}
+
+static struct ovsrcu_perthread* ovsrcu_perthread_get(void)
+{
+    struct ovsrcu_perthread *perthread = ovsrcu_self;
+
+    if (OVS_LIKELY(perthread)) {
+        return perthread;
+    }
+
+    pthread_once(&ovsrcu_once, ovsrcu_init_module);
+
+    if (posix_memalign((void **)&perthread, OVSRCU_CACHE_LINE_SIZE, sizeof *perthread)) {
+        VLOG_ERROR("failed to alloc RCU per-thread state");
+        abort();
+    }
+
+    /* A new thread is about to read, as in OVS. */
+    perthread->seqno = __atomic_load_n(&ovsrcu_seqno, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&ovsrcu_mutex);
+    ovs_list_push_back(&ovsrcu_threads, &perthread->list_node);
+    pthread_mutex_unlock(&ovsrcu_mutex);
+
+    pthread_setspecific(ovsrcu_key, perthread);
+    ovsrcu_self = perthread;
+
+    return perthread;
+}
+
+/* The stores are sequentially consistent so that a reader's later loads of
+ * RCU-protected pointers cannot be ordered before them. */
+static void ovsrcu_set_seqno(struct ovsrcu_perthread *perthread, uint64_t seqno)
+{
+    __atomic_store_n(&perthread->seqno, seqno, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the smallest seqno of the non-quiescent threads. */
+static uint64_t ovsrcu_min_seqno(void)
+{
+    struct ovsrcu_perthread *perthread;
+    uint64_t seqno, min = OVSRCU_QUIESCENT;
+
+    LIST_FOR_EACH (perthread, list_node, &ovsrcu_threads) {
+        seqno = __atomic_load_n(&perthread->seqno, __ATOMIC_SEQ_CST);
+        if (seqno < min) {
+            min = seqno;
+        }
+    }
+
+    return min;
+}
+
+static void ovsrcu_run_callbacks(void)
+{
+    struct ovs_list ready = OVS_LIST_INITIALIZER(&ready);
+    struct ovsrcu_cb *cb, *next;
+    uint64_t min;
+
+    if (!__atomic_load_n(&ovsrcu_n_cbs, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&ovsrcu_mutex);
+    min = ovsrcu_min_seqno();
+    LIST_FOR_EACH_SAFE (cb, next, list_node, &ovsrcu_cbs) {
+        if (cb->seqno > min) {
+            break;
+        }
+
+        ovs_list_remove(&cb->list_node);
+        ovs_list_push_back(&ready, &cb->list_node);
+        __atomic_sub_fetch(&ovsrcu_n_cbs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ovsrcu_mutex);
+
+    LIST_FOR_EACH_POP (cb, list_node, &ready) {
+        cb->function(cb->aux);
+        free(cb);
+    }
+}
+
+void ovsrcu_postpone__(void (*function)(void *aux), void *aux)
+{
+    struct ovsrcu_cb *cb = malloc(sizeof *cb);
+
+    if (!cb) {
+        VLOG_ERROR("failed to alloc RCU callback");
+        abort();
+    }
+
+    cb->function = function;
+    cb->aux = aux;
+
+    /* Bumping the seqno under the mutex keeps 'ovsrcu_cbs' sorted. */
+    pthread_mutex_lock(&ovsrcu_mutex);
+    cb->seqno = __atomic_add_fetch(&ovsrcu_seqno, 1, __ATOMIC_SEQ_CST);
+    ovs_list_push_back(&ovsrcu_cbs, &cb->list_node);
+    __atomic_add_fetch(&ovsrcu_n_cbs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ovsrcu_mutex);
+}
+
+/* Marks the calling thread as not holding any RCU-protected pointer until
+ * the next ovsrcu_quiesce_end(). */
+void ovsrcu_quiesce_start(void)
+{
+    ovsrcu_set_seqno(ovsrcu_perthread_get(), OVSRCU_QUIESCENT);
+    ovsrcu_run_callbacks();
+}
+
+/* Lets the calling thread read RCU-protected pointers again. */
+void ovsrcu_quiesce_end(void)
+{
+    ovsrcu_set_seqno(ovsrcu_perthread_get(),
+                     __atomic_load_n(&ovsrcu_seqno, __ATOMIC_SEQ_CST));
+}
+
+/* Declares that the calling thread no longer holds any RCU-protected
+ * pointer it got before this call. */
+void ovsrcu_quiesce(void)
+{
+    ovsrcu_set_seqno(ovsrcu_perthread_get(),
+                     __atomic_load_n(&ovsrcu_seqno, __ATOMIC_SEQ_CST));
+    ovsrcu_run_callbacks();
+}
+
+bool ovsrcu_is_quiescent(void)
+{
+    return !ovsrcu_self
+           || __atomic_load_n(&ovsrcu_self->seqno, __ATOMIC_RELAXED) == OVSRCU_QUIESCENT;
+}
+
+/* Waits until every other thread has passed a quiescent point, then runs
+ * the callbacks that became safe. The calling thread must not hold any
+ * RCU-protected pointer. */
+void ovsrcu_synchronize(void)
+{
+    bool was_quiescent = ovsrcu_is_quiescent();
+    struct ovsrcu_perthread *perthread = ovsrcu_perthread_get();
+    uint64_t target, min;
+
+    target = __atomic_add_fetch(&ovsrcu_seqno, 1, __ATOMIC_SEQ_CST);
+    ovsrcu_set_seqno(perthread, OVSRCU_QUIESCENT);
+
+    for (;;) {
+        pthread_mutex_lock(&ovsrcu_mutex);
+        min = ovsrcu_min_seqno();
+        pthread_mutex_unlock(&ovsrcu_mutex);
+
+        if (min >= target) {
+            break;
+        }
+
+        sched_yield();
+    }
+
+    ovsrcu_run_callbacks();
+
+    if (!was_quiescent) {
+        ovsrcu_quiesce_end();
+    }
+}
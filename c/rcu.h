@@ -0,0 +1,89 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+/* Read-Copy-Update, after OVS lib/ovs-rcu.h
+ *
+ * Same API as the OVS one, so code using it ports to OVS by switching the
+ * include to "ovs-rcu.h". Only the subset needed here is provided.
+ *
+ * Readers load an RCU-protected pointer with ovsrcu_get() and use it
+ * without taking any reference. Writers publish a new version with
+ * ovsrcu_set() and hand the old one to ovsrcu_postpone(), which frees it
+ * once every thread that might still be using it has passed a quiescent
+ * point.
+ *
+ * A thread is quiescent while it holds no RCU-protected pointer. A thread
+ * becomes a reader, not quiescent, at its first ovsrcu_get(),
+ * ovsrcu_quiesce_end() or ovsrcu_quiesce(). Readers call ovsrcu_quiesce()
+ * regularly, e.g. once per packet burst, and ovsrcu_quiesce_start() before
+ * blocking for a long time or exiting; after it, ovsrcu_quiesce_end()
+ * comes before the next ovsrcu_get(). None of these write memory shared
+ * with other readers; ovsrcu_get() only writes on the first call of a
+ * thread.
+ *
+ * Postponed callbacks run from ovsrcu_quiesce(), ovsrcu_quiesce_start() and
+ * ovsrcu_synchronize() in whichever thread first finds them safe to run.
+ */
+
+#include <stdbool.h>
+
+#include "util.h"
+
+#define OVSRCU_TYPE(TYPE) struct { TYPE p; }
+#define OVSRCU_INITIALIZER(VALUE) { VALUE }
+
+/* Reads an RCU-protected pointer, for use by readers. */
+#define ovsrcu_get(TYPE, VAR) \
+    (ovsrcu_check_reader__(), \
+     (TYPE) __atomic_load_n(&(VAR)->p, __ATOMIC_CONSUME))
+
+/* Reads an RCU-protected pointer from the writer side, where it cannot
+ * change underneath. */
+#define ovsrcu_get_protected(TYPE, VAR) \
+    ((TYPE) __atomic_load_n(&(VAR)->p, __ATOMIC_RELAXED))
+
+/* Publishes 'VALUE'; everything written to it before is visible to readers
+ * that get it. */
+#define ovsrcu_set(VAR, VALUE) \
+    __atomic_store_n(&(VAR)->p, VALUE, __ATOMIC_RELEASE)
+
+/* Initializes 'VAR' for a pointer no reader can see yet. */
+#define ovsrcu_set_hidden(VAR, VALUE) \
+    __atomic_store_n(&(VAR)->p, VALUE, __ATOMIC_RELAXED)
+
+#define ovsrcu_init(VAR, VALUE) ovsrcu_set_hidden(VAR, VALUE)
+
+/* Calls FUNCTION(ARG) once no thread can hold a pointer obtained before
+ * this call. */
+#define ovsrcu_postpone(FUNCTION, ARG)                          \
+    (/* Verify that ARG is appropriate for FUNCTION. */        \
+     (void) sizeof((FUNCTION)(ARG), 1),                         \
+     /* Verify that ARG is a pointer type. */                   \
+     (void) sizeof(*(ARG)),                                     \
+     ovsrcu_postpone__((void (*)(void *))(FUNCTION), ARG))
+
+void ovsrcu_postpone__(void (*function)(void *aux), void *aux);
+
+void ovsrcu_quiesce_start(void);
+void ovsrcu_quiesce_end(void);
+void ovsrcu_quiesce(void);
+bool ovsrcu_is_quiescent(void);
+void ovsrcu_synchronize(void);
+
+/* Per-thread state of the calling thread, NULL until its first RCU call. */
+struct ovsrcu_perthread;
+extern __thread struct ovsrcu_perthread *ovsrcu_self;
+
+/* Registers the calling thread as a reader on its first ovsrcu_get(). Debug
+ * builds also catch a read from a thread that declared itself quiescent. */
+static inline void ovsrcu_check_reader__(void)
+{
+    if (OVS_UNLIKELY(!ovsrcu_self)) {
+        ovsrcu_quiesce_end();
+    }
+#ifndef NDEBUG
+    ovs_assert(!ovsrcu_is_quiescent());
+#endif
+}
+
+#endif
@@ -1,147 +1,785 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "test_vector.h"
+#include "util.h"
 
-test_vector_t* load_test_vector(char *test_vect_file) 
+/* The file is mapped and scanned once, line by line. The fields are parsed
+ * in place by the scanners below, which stop at the end of the map: no
+ * line is copied or split into tokens. The flows are stored in one array
+ * per field, grown in chunks, about 22 bytes a flow (54 with IPv6 ones).
+ * The pages of the map already scanned are dropped as the scan goes, so a
+ * capture much larger than the memory can be replayed.
+ *
+ * Flow lines:
+ *   sip sport dip dport [protocol [hash [bucket_id]]]
+ * with IPv4 or IPv6 addresses, the protocol 6 (tcp) by default. The fields
+ * are separated by blanks, an IPv4 address from its port also by a ':'. */
+
+#define TV_CHUNK        4096        /* flows the arrays grow by, at least */
+#define TV_LINE_BYTES   40          /* guess of the size of a flow line */
+#define TV_WINDOW       (16 << 20)  /* bytes of the map kept behind the scan */
+
+static inline bool tv_is_blank(char c)
 {
-    FILE *fp;
-    char buffer[1024];
-    char *fname = test_vect_file;
-    test_vector_t *tv = calloc(1, sizeof(test_vector_t));
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-    VLOG_INFO("Load hash entries from %s", fname);
+/* the end of a field: a blank, the end of the line or of the map */
+static inline bool tv_field_end(const char *p, const char *end)
+{
+    return p == end || tv_is_blank(*p) || *p == '\n';
+}
 
-    ovs_list_init(&tv->tv_list);
+static inline const char* tv_skip_blanks(const char *p, const char *end)
+{
+    while (p < end && tv_is_blank(*p)) {
+        p++;
+    }
+    return p;
+}
 
-    fp = fopen(fname, "r");
-    if (fp == NULL) {
-        VLOG_ERROR("failed to open file: %s", fname);
-        return NULL;
+/* skips the separator after a field, at least one blank or ':' */
+static inline bool tv_skip_sep(const char **pp, const char *end, bool colon)
+{
+    const char *p = *pp;
+
+    while (p < end && (tv_is_blank(*p) || (colon && *p == ':'))) {
+        p++;
+    }
+    if (p == *pp) {
+        return false;
+    }
+
+    *pp = p;
+    return true;
+}
+
+static inline bool tv_is_digit(char c)
+{
+    return (unsigned char) (c - '0') < 10;
+}
+
+static inline int tv_hex_digit(char c)
+{
+    if (tv_is_digit(c)) {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* decimal, at most 'max' */
+static bool tv_scan_u32(const char **pp, const char *end, uint32_t max, uint32_t *v)
+{
+    const char *p = *pp;
+    uint64_t n = 0;
+
+    while (p < end && tv_is_digit(*p)) {
+        n = n * 10 + (*p++ - '0');
+        if (n > max) {
+            return false;
+        }
+    }
+    if (p == *pp) {
+        return false;
+    }
+
+    *pp = p;
+    *v = n;
+    return true;
+}
+
+/* hexadecimal, with or without 0x */
+static bool tv_scan_hex32(const char **pp, const char *end, uint32_t *v)
+{
+    const char *p = *pp;
+    const char *digits;
+    uint64_t n = 0;
+    int d;
+
+    if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+        p += 2;
+    }
+    for (digits = p; p < end && (d = tv_hex_digit(*p)) >= 0; p++) {
+        n = n << 4 | d;
+        if (n > UINT32_MAX) {
+            return false;
+        }
+    }
+    if (p == digits) {
+        return false;
+    }
+
+    *pp = p;
+    *v = n;
+    return true;
+}
+
+/* dotted quad, in network order */
+static bool tv_scan_ipv4(const char **pp, const char *end, uint32_t *addr)
+{
+    const char *p = *pp;
+    uint8_t bytes[4];
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (i && (p == end || *p++ != '.')) {
+            return false;
+        }
+
+        /* 1 to 3 digits */
+        if (p == end || !tv_is_digit(*p)) {
+            return false;
+        }
+        v = *p++ - '0';
+        if (p < end && tv_is_digit(*p)) {
+            v = v * 10 + (*p++ - '0');
+            if (p < end && tv_is_digit(*p)) {
+                v = v * 10 + (*p++ - '0');
+            }
+        }
+        if (v > 255 || (p < end && tv_is_digit(*p))) {
+            return false;
+        }
+        bytes[i] = v;
+    }
+
+    *pp = p;
+    memcpy(addr, bytes, sizeof *addr);
+    return true;
+}
+
+/* RFC 4291 text form: "::" for zero words, a dotted quad for the last 32
+ * bits */
+static bool tv_scan_ipv6(const char **pp, const char *end, struct in6_addr *addr)
+{
+    const char *p = *pp;
+    const char *word;
+    uint8_t bytes[16];
+    int n = 0, gap = -1;        /* words, words before the "::" */
+    bool more = true;           /* a word is due */
+    uint32_t v;
+    int d;
+
+    if (end - p >= 2 && p[0] == ':' && p[1] == ':') {
+        gap = 0;
+        p += 2;
+        more = false;
+    }
+
+    while (n < 8 && p < end) {
+        word = p;
+        for (v = 0; p < end && p - word < 4 && (d = tv_hex_digit(*p)) >= 0; p++) {
+            v = v << 4 | d;
+        }
+        if (p == word) {
+            break;
+        }
+
+        if (p < end && *p == '.') {
+            p = word;
+            if (n > 6 || !tv_scan_ipv4(&p, end, &v)) {
+                return false;
+            }
+            memcpy(&bytes[n * 2], &v, sizeof v);
+            n += 2;
+            more = false;
+            break;
+        }
+
+        bytes[n * 2] = v >> 8;
+        bytes[n * 2 + 1] = v;
+        n++;
+        more = false;
+
+        if (p == end || *p != ':') {
+            break;
+        }
+        if (end - p >= 2 && p[1] == ':') {
+            if (gap >= 0) {
+                return false;
+            }
+            gap = n;
+            p += 2;
+        } else {
+            p++;
+            more = true;
+        }
+    }
+
+    if (more || (gap < 0 ? n != 8 : n == 8)) {
+        return false;
+    }
+
+    if (gap >= 0) {
+        memmove(&bytes[16 - (n - gap) * 2], &bytes[gap * 2], (n - gap) * 2);
+        memset(&bytes[gap * 2], 0, (8 - n) * 2);
+    }
+
+    *pp = p;
+    memcpy(addr, bytes, sizeof bytes);
+    return true;
+}
+
+/* an address of either family, 4 or 6, 0 if none */
+static int tv_scan_addr(const char **pp, const char *end, uint32_t *ip4, struct in6_addr *ip6)
+{
+    const char *p = *pp;
+
+    if (tv_scan_ipv4(&p, end, ip4) && (tv_field_end(p, end) || *p == ':')) {
+        *pp = p;
+        return 4;
+    }
+
+    p = *pp;
+    if (tv_scan_ipv6(&p, end, ip6) && tv_field_end(p, end)) {
+        *pp = p;
+        return 6;
+    }
+
+    return 0;
+}
+
+/* the flow of the line at 'p', up to 'end' */
+static bool tv_parse_flow(const char *p, const char *end, struct tv_entry *e)
+{
+    int sfamily, dfamily;
+    uint32_t v;
+
+    memset(e, 0, sizeof *e);
+    e->protocol = 6; // tcp
+
+    sfamily = tv_scan_addr(&p, end, &e->sip, &e->sip6);
+    if (!sfamily || !tv_skip_sep(&p, end, sfamily == 4)) {
+        return false;
+    }
+    if (!tv_scan_u32(&p, end, UINT16_MAX, &v) || !tv_skip_sep(&p, end, false)) {
+        return false;
+    }
+    e->sport = htons(v);
+
+    dfamily = tv_scan_addr(&p, end, &e->dip, &e->dip6);
+    if (dfamily != sfamily || !tv_skip_sep(&p, end, dfamily == 4)) {
+        return false;
+    }
+    if (!tv_scan_u32(&p, end, UINT16_MAX, &v)) {
+        return false;
+    }
+    e->dport = htons(v);
+    e->is_ipv6 = sfamily == 6;
+
+    /* the optional fields, up to the end of the line */
+    if (!tv_skip_sep(&p, end, false) || p == end) {
+        return tv_field_end(p, end);
+    }
+    if (!tv_scan_u32(&p, end, UINT8_MAX, &v)) {
+        return false;
+    }
+    e->protocol = v;
+
+    if (!tv_skip_sep(&p, end, false) || p == end) {
+        return tv_field_end(p, end);
+    }
+    if (!tv_scan_hex32(&p, end, &e->hash)) {
+        return false;
+    }
+
+    if (!tv_skip_sep(&p, end, false) || p == end) {
+        return tv_field_end(p, end);
+    }
+    if (!tv_scan_u32(&p, end, UINT32_MAX, &e->bkt_id)) {
+        return false;
+    }
+
+    return tv_field_end(p, end);
+}
+
+/* "name:value" of the group, before the flows. Returns false if the line
+ * is not one. */
+static bool tv_parse_config(test_vector_t *tv, const char *p, const char *end)
+{
+    static const struct {
+        const char  *name;
+        size_t      offset;         /* of the uint32_t, SIZE_MAX: maglev_hash2 */
+    } keys[] = {
+        { "maglev_hash_table_size_index", offsetof(test_vector_t, maglev_hash_table_size_index) },
+        { "maglev_id", offsetof(test_vector_t, maglev_id) },
+        { "num_buckets", offsetof(test_vector_t, num_buckets) },
+        { "bucket_weight", offsetof(test_vector_t, bucket_weight) },
+        { "maglev_hash2", SIZE_MAX },
+    };
+    const char *name = p;
+    const char *value;
+    size_t len, i;
+
+    while (p < end && *p != ':' && !tv_field_end(p, end)) {
+        p++;
+    }
+    len = p - name;
+    p = tv_skip_blanks(p, end);
+    if (p == end || *p != ':') {
+        return false;
+    }
+    p = tv_skip_blanks(p + 1, end);
+
+    for (i = 0; i < ARRAY_SIZE(keys); i++) {
+        if (strlen(keys[i].name) == len && !memcmp(keys[i].name, name, len)) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(keys)) {
+        return false;
+    }
+
+    if (keys[i].offset == SIZE_MAX) {
+        for (value = p; !tv_field_end(p, end); p++) {
+            continue;
+        }
+        free(tv->maglev_hash2);
+        tv->maglev_hash2 = strndup(value, p - value);
+    } else if (!tv_scan_u32(&p, end, UINT32_MAX, (uint32_t *) ((char *) tv + keys[i].offset))) {
+        return false;
+    }
+
+    return true;
+}
+
+static bool tv_resize(void **p, size_t n, size_t size)
+{
+    void *q = realloc(*p, n * size);
+
+    if (q == NULL) {
+        return false;
+    }
+
+    *p = q;
+    return true;
+}
+
+#define TV_RESIZE(PTR, N) tv_resize((void **) &(PTR), (N), sizeof *(PTR))
+
+/* the arrays to 'n' flows */
+static bool tv_reserve(test_vector_t *tv, uint32_t n)
+{
+    n = MAX(n, 1);
+
+    if (!TV_RESIZE(tv->protocol, n) || !TV_RESIZE(tv->sip, n) || !TV_RESIZE(tv->dip, n) ||
+        !TV_RESIZE(tv->sport, n) || !TV_RESIZE(tv->dport, n) || !TV_RESIZE(tv->hash, n) ||
+        !TV_RESIZE(tv->bkt_id, n)) {
+        return false;
     }
+    if (tv->is_ipv6 &&
+        (!TV_RESIZE(tv->is_ipv6, n) || !TV_RESIZE(tv->sip6, n) || !TV_RESIZE(tv->dip6, n))) {
+        return false;
+    }
+
+    tv->allocated = n;
+    return true;
+}
 
-    char *token;
-    char *delimiters = " :";
-    char *b;
+/* the IPv6 arrays, from the first IPv6 flow on */
+static bool tv_enable_ipv6(test_vector_t *tv)
+{
+    tv->is_ipv6 = calloc(tv->allocated, sizeof *tv->is_ipv6);
+    tv->sip6 = calloc(tv->allocated, sizeof *tv->sip6);
+    tv->dip6 = calloc(tv->allocated, sizeof *tv->dip6);
+
+    return tv->is_ipv6 && tv->sip6 && tv->dip6;
+}
+
+static bool tv_add_flow(test_vector_t *tv, const struct tv_entry *e)
+{
+    uint32_t i = tv->num_tv_entries;
+
+    if (OVS_UNLIKELY(i == tv->allocated) &&
+        (i == UINT32_MAX || !tv_reserve(tv, i + MIN(MAX(i / 2, TV_CHUNK), UINT32_MAX - i)))) {
+        return false;
+    }
+    if (OVS_UNLIKELY(e->is_ipv6 && !tv->is_ipv6) && !tv_enable_ipv6(tv)) {
+        return false;
+    }
+
+    tv->protocol[i] = e->protocol;
+    tv->sip[i] = e->sip;
+    tv->dip[i] = e->dip;
+    tv->sport[i] = e->sport;
+    tv->dport[i] = e->dport;
+    tv->hash[i] = e->hash;
+    tv->bkt_id[i] = e->bkt_id;
+    if (tv->is_ipv6) {
+        tv->is_ipv6[i] = e->is_ipv6;
+        tv->sip6[i] = e->sip6;
+        tv->dip6[i] = e->dip6;
+    }
+
+    tv->num_tv_entries++;
+    return true;
+}
+
+static bool tv_parse(test_vector_t *tv, const char *p, const char *end, const char *fname)
+{
+    const char *eol;
+    const char *scanned = p;    /* start of the pages still mapped in */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len;
+    struct tv_entry entry;
+    uint32_t line = 0, skipped = 0;
     int begin_hash = 0;
 
-    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-        b = trim(buffer);
-        if (strlen(buffer) < 1) {
+    for (; p < end; p = eol + (eol < end)) {
+        line++;
+        if (OVS_UNLIKELY(p - scanned >= TV_WINDOW)) {
+            len = (p - scanned) & ~(page - 1);
+            madvise((void *) scanned, len, MADV_DONTNEED);
+            scanned += len;
+        }
+
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        p = tv_skip_blanks(p, eol);
+        if (p == eol || *p == '#') {
             continue;
-        } else if (buffer[0] == '#') {
+        }
+
+        if (!begin_hash && tv_parse_config(tv, p, eol)) {
             continue;
-        } 
-
-        if (begin_hash == 0) {
-            // continue
-            token = strtok(b, delimiters);
-            if (strcmp("maglev_hash_table_size_index" , token) == 0) {
-                token = strtok(NULL, delimiters);
-                tv->maglev_hash_table_size_index = atoi(token);
-                continue;
-            } else if (strcmp("maglev_id" , token) == 0) {
-                token = strtok(NULL, delimiters);
-                tv->maglev_id = atoi(token);
-                continue;
-            } else if (strcmp("maglev_hash2" , token) == 0) {
-                token = strtok(NULL, delimiters);
-                tv->maglev_hash2 = strdup(token);
-                continue;
-            } else if (strcmp("num_buckets" , token) == 0) {
-                token = strtok(NULL, delimiters);
-                tv->num_buckets = atoi(token);
-                continue;
-            } else if (strcmp("bucket_weight" , token) == 0) {
-                token = strtok(NULL, delimiters);
-                tv->bucket_weight = atoi(token);
-                continue;
-            } else if (token[0] < '0' || '9' < token[0]) {
-                // not IP string
-                VLOG_INFO("Unknown data: %s", b);
-                continue;
-            } else {
-                begin_hash = 1;
-            }
-        } else {
-            token = strtok(b, delimiters);
-        }
-
-        struct tv_entry *entry = calloc(1, sizeof(struct tv_entry));
-        entry->protocol = 6; // tcp
-
-        int idx=0;
-        char *endptr;
-        while (token != NULL) {
-            switch (idx) {
-            case 0:
-                entry->sip = ip2int(token);
-                break;
-            case 1:
-                entry->sport =  atoi(token);
-                entry->sport = htons(entry->sport);
-                break;
-            case 2:
-                entry->dip = ip2int(token);
-                break;
-            case 3:
-                entry->dport = atoi(token);
-                entry->dport = htons(entry->dport);
-                break;
-            case 4:
-                entry->protocol = atoi(token);
-                break;
-            case 5:
-                entry->hash = strtol(token, &endptr, 16);
-                break;
-            case 6:
-                entry->bkt_id =  atoi(token);
-                break;
+        }
+
+        if (!tv_parse_flow(p, eol, &entry)) {
+            if (!begin_hash) {
+                VLOG_INFO("Unknown data: %.*s", (int) (eol - p), p);
+            } else if (skipped++ < 10) {
+                VLOG_WARN("%s:%u: bad flow: %.*s", fname, line, (int) (eol - p), p);
             }
+            continue;
+        }
+        begin_hash = 1;
 
-            idx++;
-            token = strtok(NULL, delimiters);
+        if (!tv_add_flow(tv, &entry)) {
+            VLOG_ERROR("no memory for %u hash entries", tv->num_tv_entries + 1);
+            return false;
         }
+    }
+
+    if (skipped) {
+        VLOG_WARN("%s: %u bad flows skipped", fname, skipped);
+    }
+
+    return true;
+}
+
+/* Binary test vectors, written by save_test_vector_bin() and mapped by
+ * load_test_vector() with no parsing: a header with the group config and
+ * where each flow column is, then the columns, the arrays of
+ * test_vector_t as they are in memory, each at a multiple of TV_BIN_ALIGN.
+ * Numbers are in the byte order of the writer, which the header records;
+ * a host of the other order refuses the file. */
+#define TV_BIN_MAGIC        "MHTVBIN"       /* with its NUL, 8 bytes */
+#define TV_BIN_VERSION      1
+#define TV_BIN_BYTE_ORDER   0x01020304
+#define TV_BIN_ALIGN        64
 
-        ovs_list_init(&entry->node);
-        ovs_list_push_back(&tv->tv_list, &entry->node);
-        tv->num_tv_entries ++;
+enum {
+    TV_BIN_PROTOCOL,
+    TV_BIN_SIP,
+    TV_BIN_DIP,
+    TV_BIN_SPORT,
+    TV_BIN_DPORT,
+    TV_BIN_HASH,
+    TV_BIN_BKT_ID,
+    TV_BIN_IS_IPV6,             /* these 3 absent without IPv6 flows */
+    TV_BIN_SIP6,
+    TV_BIN_DIP6,
+    TV_BIN_N_COLUMNS
+};
 
-#if 0
-        VLOG_DEBUG("Hash node(%d): 0x%x:0x%x->0x%x:0x%x %d 0x%x %d", 
-                   tv->num_tv_entries,
-                   entry->sip,
-                   entry->sport,
-                   entry->dip,
-                   entry->dport,
-                   entry->protocol,
-                   entry->hash,
-                   entry->bkt_id);
-#endif
+struct tv_bin_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byte_order;
+    uint32_t    maglev_hash_table_size_index;
+    uint32_t    maglev_id;
+    uint32_t    num_buckets;
+    uint32_t    bucket_weight;
+    char        maglev_hash2[16];           /* NUL-terminated, "" if none */
+    uint64_t    n_flows;
+    struct {
+        uint64_t    offset;                 /* in the file, 0 if absent */
+        uint64_t    size;                   /* n_flows * width */
+    } columns[TV_BIN_N_COLUMNS];
+};
 
+static const struct {
+    size_t  field;              /* of the array in test_vector_t */
+    size_t  width;              /* bytes a flow */
+} tv_bin_columns[TV_BIN_N_COLUMNS] = {
+    [TV_BIN_PROTOCOL] = { offsetof(test_vector_t, protocol), sizeof(uint8_t) },
+    [TV_BIN_SIP]      = { offsetof(test_vector_t, sip), sizeof(uint32_t) },
+    [TV_BIN_DIP]      = { offsetof(test_vector_t, dip), sizeof(uint32_t) },
+    [TV_BIN_SPORT]    = { offsetof(test_vector_t, sport), sizeof(uint16_t) },
+    [TV_BIN_DPORT]    = { offsetof(test_vector_t, dport), sizeof(uint16_t) },
+    [TV_BIN_HASH]     = { offsetof(test_vector_t, hash), sizeof(uint32_t) },
+    [TV_BIN_BKT_ID]   = { offsetof(test_vector_t, bkt_id), sizeof(uint32_t) },
+    [TV_BIN_IS_IPV6]  = { offsetof(test_vector_t, is_ipv6), sizeof(uint8_t) },
+    [TV_BIN_SIP6]     = { offsetof(test_vector_t, sip6), sizeof(struct in6_addr) },
+    [TV_BIN_DIP6]     = { offsetof(test_vector_t, dip6), sizeof(struct in6_addr) },
+};
+
+/* the array of column 'i' in 'tv' */
+static inline void** tv_bin_column(const test_vector_t *tv, int i)
+{
+    return (void **) ((char *) tv + tv_bin_columns[i].field);
+}
+
+static bool tv_is_bin(const char *map, size_t size)
+{
+    return size >= sizeof TV_BIN_MAGIC && !memcmp(map, TV_BIN_MAGIC, sizeof TV_BIN_MAGIC);
+}
+
+/* points the arrays of 'tv' in the columns of the file mapped at 'map',
+ * which 'tv' keeps, even on failure */
+static bool tv_map_bin(test_vector_t *tv, char *map, size_t size, const char *fname)
+{
+    const struct tv_bin_header *h = (const struct tv_bin_header *) map;
+    uint64_t offset, len;
+    int i, n_ipv6 = 0;
+
+    tv->map = map;
+    tv->map_size = size;
+
+    if (size < sizeof *h || h->byte_order != TV_BIN_BYTE_ORDER) {
+        VLOG_ERROR("%s: truncated, or written on a host of the other byte order", fname);
+        return false;
+    }
+    if (h->version != TV_BIN_VERSION) {
+        VLOG_ERROR("%s: binary test vector version %u, %u supported", fname, h->version,
+                   TV_BIN_VERSION);
+        return false;
+    }
+    if (h->n_flows > UINT32_MAX ||
+        !memchr(h->maglev_hash2, '\0', sizeof h->maglev_hash2)) {
+        VLOG_ERROR("%s: corrupted header", fname);
+        return false;
     }
 
-    VLOG_INFO("Hash nodes to be verified: %d", tv->num_tv_entries);
+    for (i = 0; i < TV_BIN_N_COLUMNS; i++) {
+        offset = h->columns[i].offset;
+        len = h->n_flows * tv_bin_columns[i].width;
 
-    fclose(fp);
+        if (!offset && i >= TV_BIN_IS_IPV6) {
+            continue;
+        }
+        if (!offset || offset % TV_BIN_ALIGN || h->columns[i].size != len ||
+            offset > size || len > size - offset) {
+            VLOG_ERROR("%s: corrupted column %d", fname, i);
+            return false;
+        }
 
-    return tv;
+        *tv_bin_column(tv, i) = map + offset;
+        n_ipv6 += i >= TV_BIN_IS_IPV6;
+    }
+    if (n_ipv6 && n_ipv6 != TV_BIN_N_COLUMNS - TV_BIN_IS_IPV6) {
+        VLOG_ERROR("%s: partial IPv6 columns", fname);
+        return false;
+    }
+
+    tv->maglev_hash_table_size_index = h->maglev_hash_table_size_index;
+    tv->maglev_id = h->maglev_id;
+    tv->num_buckets = h->num_buckets;
+    tv->bucket_weight = h->bucket_weight;
+    tv->maglev_hash2 = h->maglev_hash2[0] ? strdup(h->maglev_hash2) : NULL;
+    tv->num_tv_entries = h->n_flows;
+    tv->allocated = h->n_flows;
+
+    return true;
 }
 
-int free_test_vector(test_vector_t *tv) 
+/* Writes 'tv' to 'file' in the binary format, for load_test_vector().
+ * Returns 0 or a negative errno value. */
+int save_test_vector_bin(const test_vector_t *tv, const char *file)
 {
-    struct tv_entry *h, *next;
+    static const char pad[TV_BIN_ALIGN];
+    struct tv_bin_header h;
+    const void *column;
+    uint64_t offset, pos;
+    bool ok;
+    FILE *fp;
+    int i;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TV_BIN_MAGIC, sizeof h.magic);
+    h.version = TV_BIN_VERSION;
+    h.byte_order = TV_BIN_BYTE_ORDER;
+    h.maglev_hash_table_size_index = tv->maglev_hash_table_size_index;
+    h.maglev_id = tv->maglev_id;
+    h.num_buckets = tv->num_buckets;
+    h.bucket_weight = tv->bucket_weight;
+    if (tv->maglev_hash2) {
+        if (strlen(tv->maglev_hash2) >= sizeof h.maglev_hash2) {
+            VLOG_ERROR("maglev_hash2 too long: %s", tv->maglev_hash2);
+            return -EINVAL;
+        }
+        strcpy(h.maglev_hash2, tv->maglev_hash2);
+    }
+    h.n_flows = tv->num_tv_entries;
 
-    LIST_FOR_EACH_SAFE(h, next, node, &tv->tv_list) {
-        ovs_list_remove(&h->node);
+    offset = ROUND_UP(sizeof h, TV_BIN_ALIGN);
+    for (i = 0; i < TV_BIN_N_COLUMNS; i++) {
+        if (*tv_bin_column(tv, i) == NULL) {
+            continue;
+        }
+        h.columns[i].offset = offset;
+        h.columns[i].size = h.n_flows * tv_bin_columns[i].width;
+        offset = ROUND_UP(offset + h.columns[i].size, TV_BIN_ALIGN);
+    }
 
-        //VLOG_INFO("free input data: %p", h);
-        free(h);
+    fp = fopen(file, "wb");
+    if (fp == NULL) {
+        VLOG_ERROR("failed to open file: %s", file);
+        return -errno;
     }
 
+    ok = fwrite(&h, sizeof h, 1, fp) == 1;
+    pos = sizeof h;
+    for (i = 0; ok && i < TV_BIN_N_COLUMNS; i++) {
+        column = *tv_bin_column(tv, i);
+        if (column == NULL) {
+            continue;
+        }
+        ok = fwrite(pad, 1, h.columns[i].offset - pos, fp) == h.columns[i].offset - pos &&
+             fwrite(column, 1, h.columns[i].size, fp) == h.columns[i].size;
+        pos = h.columns[i].offset + h.columns[i].size;
+    }
+
+    if (fclose(fp) != 0 || !ok) {
+        VLOG_ERROR("failed to write file: %s", file);
+        remove(file);
+        return -EIO;
+    }
+
+    VLOG_INFO("%u hash entries written to %s", tv->num_tv_entries, file);
+
     return 0;
 }
 
+test_vector_t* load_test_vector(char *test_vect_file)
+{
+    char *fname = test_vect_file;
+    struct stat st;
+    char *map = NULL;
+    bool ok;
+    int fd;
+
+    VLOG_INFO("Load hash entries from %s", fname);
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        VLOG_ERROR("failed to open file: %s", fname);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            VLOG_ERROR("failed to map file: %s", fname);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    test_vector_t *tv = calloc(1, sizeof(test_vector_t));
+
+    if (tv && map && tv_is_bin(map, st.st_size)) {
+        ok = tv_map_bin(tv, map, st.st_size, fname);
+    } else {
+        ok = tv && tv_reserve(tv, MIN(st.st_size / TV_LINE_BYTES + TV_CHUNK, UINT32_MAX));
+        if (ok && map) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            ok = tv_parse(tv, map, map + st.st_size, fname);
+        }
+
+        if (map) {
+            munmap(map, st.st_size);
+        }
+
+        /* give back the room of the guess */
+        ok = ok && tv_reserve(tv, tv->num_tv_entries);
+    }
+
+    if (!ok) {
+        if (tv) {
+            free_test_vector(tv);
+        }
+        return NULL;
+    }
+
+    VLOG_INFO("Hash nodes to be verified: %d%s", tv->num_tv_entries,
+              tv->is_ipv6 ? " (with IPv6)" : "");
+
+    return tv;
+}
+
+int free_test_vector(test_vector_t *tv)
+{
+    free(tv->maglev_hash2);
+
+    if (tv->map) {
+        munmap(tv->map, tv->map_size);
+        free(tv);
+        return 0;
+    }
+
+    free(tv->protocol);
+    free(tv->sip);
+    free(tv->dip);
+    free(tv->sport);
+    free(tv->dport);
+    free(tv->is_ipv6);
+    free(tv->sip6);
+    free(tv->dip6);
+    free(tv->hash);
+    free(tv->bkt_id);
+    free(tv);
+
+    return 0;
+}
+
+/* Flow 'i' of 'tv' */
+void tv_get_entry(const test_vector_t *tv, uint32_t i, struct tv_entry *entry)
+{
+    memset(entry, 0, sizeof *entry);
+
+    entry->sip = tv->sip[i];
+    entry->sport = tv->sport[i];
+    entry->dip = tv->dip[i];
+    entry->dport = tv->dport[i];
+    entry->protocol = tv->protocol[i];
+    entry->hash = tv->hash[i];
+    entry->bkt_id = tv->bkt_id[i];
+    if (tv->is_ipv6 && tv->is_ipv6[i]) {
+        entry->is_ipv6 = true;
+        entry->sip6 = tv->sip6[i];
+        entry->dip6 = tv->dip6[i];
+    }
+}
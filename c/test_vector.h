@@ -1,11 +1,13 @@
 #ifndef __TEST_VECTOR_H_
 #define __TEST_VECTOR_H_
 
-#include "list.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
 
+/* One flow of a test vector, see tv_get_entry() */
 struct tv_entry {
-    struct ovs_list node;
-
     uint32_t sip;
     uint16_t sport;
     uint32_t dip;
@@ -13,6 +15,9 @@ struct tv_entry {
     uint8_t  protocol;
     uint32_t hash;
     uint32_t bkt_id;
+    bool     is_ipv6;
+    struct in6_addr sip6;   /* if is_ipv6 */
+    struct in6_addr dip6;
 };
 
 typedef struct test_vector_s {
@@ -22,13 +27,28 @@ typedef struct test_vector_s {
 	uint32_t bucket_weight;
 	char	 *maglev_hash2;
 
-    struct ovs_list tv_list;
+    /* the flows, one array per field of num_tv_entries */
+    uint8_t         *protocol;
+    uint32_t        *sip;           /* network order, 0 for IPv6 flows */
+    uint32_t        *dip;
+    uint16_t        *sport;         /* network order */
+    uint16_t        *dport;
+    uint8_t         *is_ipv6;       /* NULL without IPv6 flows */
+    struct in6_addr *sip6;          /* NULL without IPv6 flows */
+    struct in6_addr *dip6;
+    uint32_t        *hash;          /* expected hash */
+    uint32_t        *bkt_id;        /* expected bucket id */
     uint32_t num_tv_entries;
+    uint32_t allocated;             /* entries of the arrays */
+    void     *map;                  /* binary file the arrays are in, or NULL */
+    size_t   map_size;
     uint32_t mismatched;
 
 } test_vector_t;
 
 test_vector_t* load_test_vector(char *test_vect_file);
 int free_test_vector(test_vector_t *tv);
+int save_test_vector_bin(const test_vector_t *tv, const char *file);
+void tv_get_entry(const test_vector_t *tv, uint32_t i, struct tv_entry *entry);
 
 #endif
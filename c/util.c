@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <ctype.h>
 
+#include "log.h"
+#include "util.h"
+
 // network order
 uint32_t ip2int(const char *ip_str) {
 #if 1
@@ -31,9 +35,15 @@ char* trim (char *s)
     int i;
 
     while (isspace (*s)) s++;   // skip left side white spaces
-    for (i = strlen (s) - 1; (isspace (s[i])); i--) ;   // skip right side white spaces
+    for (i = strlen (s) - 1; i >= 0 && (isspace (s[i])); i--) ;   // skip right side white spaces
     s[i + 1] = '\0';
 
     return s;
 }
 
+void ovs_assert_failure(const char *where, const char *function,
+                        const char *condition)
+{
+    VLOG_ERROR("%s: assertion %s failed in %s()", where, condition, function);
+    abort();
+}
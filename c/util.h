@@ -38,6 +38,17 @@ const char *ovs_get_program_version(void);
 #define OVS_STRINGIZE(ARG) OVS_STRINGIZE2(ARG)
 #define OVS_STRINGIZE2(ARG) #ARG
 
+/* Branch prediction hints, as in OVS compiler.h. */
+#define OVS_LIKELY(CONDITION) __builtin_expect(!!(CONDITION), 1)
+#define OVS_UNLIKELY(CONDITION) __builtin_expect(!!(CONDITION), 0)
+
+/* Marks a parameter a callback does not need, as in OVS compiler.h. */
+#define OVS_UNUSED __attribute__((__unused__))
+
+/* Prefetches the cache line that contains 'addr'. */
+#define OVS_PREFETCH(addr) __builtin_prefetch((addr))
+#define OVS_PREFETCH_WRITE(addr) __builtin_prefetch((addr), 1)
+
 /* Saturating multiplication of "unsigned int"s: overflow yields UINT_MAX. */
 #define OVS_SAT_MUL(X, Y)                                               \
     ((Y) == 0 ? 0                                                       \
@@ -289,9 +300,32 @@ void ovs_assert_failure(const char *, const char *, const char *);
         EXPAND_MACRO(GET_SAFE_MACRO(MAX_ARGS), \
                      (__VA_ARGS__, LONG, SHORT))(__VA_ARGS__)
 
+#define __ARRAY_SIZE_NOCHECK(ARRAY) (sizeof(ARRAY) / sizeof((ARRAY)[0]))
+#ifdef __GNUC__
+/* return 0 for array types, 1 otherwise */
+#define __ARRAY_CHECK(ARRAY)                                    \
+    !__builtin_types_compatible_p(typeof(ARRAY), typeof(&ARRAY[0]))
+
+/* compile-time fail if not array */
+#define __ARRAY_FAIL(ARRAY) (sizeof(char[-2*!__ARRAY_CHECK(ARRAY)]))
+#define __ARRAY_SIZE(ARRAY)                                     \
+    __builtin_choose_expr(__ARRAY_CHECK(ARRAY),                 \
+        __ARRAY_SIZE_NOCHECK(ARRAY), __ARRAY_FAIL(ARRAY))
+#else
+#define __ARRAY_SIZE(ARRAY) __ARRAY_SIZE_NOCHECK(ARRAY)
+#endif
+
 /* Returns the number of elements in ARRAY. */
 #define ARRAY_SIZE(ARRAY) __ARRAY_SIZE(ARRAY)
 
+#ifndef MIN
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+#endif
+
+#ifndef MAX
+#define MAX(X, Y) ((X) > (Y) ? (X) : (Y))
+#endif
+
 /* Returns X / Y, rounding up.  X must be nonnegative to round correctly. */
 #define DIV_ROUND_UP(X, Y) (((X) + ((Y) - 1)) / (Y))
 
@@ -307,6 +341,10 @@ void ovs_assert_failure(const char *, const char *, const char *);
 /* Returns true if X is a power of 2, otherwise false. */
 #define IS_POW2(X) ((X) && !((X) & ((X) - 1)))
 
+/* This system's cache line size, in bytes.
+ * Being wrong hurts performance but not correctness. */
+#define CACHE_LINE_SIZE 64
+
 /* Expands to an anonymous union that contains:
  *
  *    - MEMBERS in a nested anonymous struct.